@@ -0,0 +1,9 @@
+# Write INPUT file into OUTPUT C++ source as `embedded_intrinsics` byte array.
+#
+file(READ "${INPUT}" content HEX)
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," content "${content}")
+file(WRITE "${OUTPUT}"
+    "#include <cstddef>\n\n"
+    "extern const unsigned char embedded_intrinsics[] = { ${content} };\n"
+    "extern const size_t embedded_intrinsics_size = sizeof(embedded_intrinsics);\n"
+)
@@ -3,13 +3,28 @@
 
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/ELFObjectFile.h>
+#include <llvm/Object/COFF.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/xxhash.h>
+
+#include <algorithm>
 
 llvm::cl::opt<std::string> binarypath("b",
     llvm::cl::desc("Path to the target Binary"),
     llvm::cl::value_desc("Binary"),
     llvm::cl::Required);
 
+// Section contains code. Packed PE images commonly have executable sections that are not marked as
+// holding code, so the memory permission is tested for them.
+//
+static bool is_executable(const llvm::object::ObjectFile& object, const llvm::object::SectionRef& section)
+{
+    if (auto coff = llvm::dyn_cast<llvm::object::COFFObjectFile>(&object))
+        return (coff->getCOFFSection(section)->Characteristics & llvm::COFF::IMAGE_SCN_MEM_EXECUTE) != 0;
+    return section.isText();
+}
+
 Binary::Binary()
 {
     auto object_or_err = llvm::object::ObjectFile::createObjectFile(binarypath);
@@ -20,48 +35,131 @@ Binary::Binary()
     }
 
     std::tie(object, memory) = object_or_err->takeBinary();
+    // Index sections by address. Only sections mapped into memory take part, ELF symbol tables and
+    // debug sections are not loaded and sit at address 0.
+    //
+    for (const auto& section : object->sections())
+    {
+        if (section.getAddress() == 0)
+            continue;
+        if (object->isELF() && (llvm::object::ELFSectionRef(section).getFlags() & llvm::ELF::SHF_ALLOC) == 0)
+            continue;
+
+        auto contents = section.getContents();
+        if (!contents)
+        {
+            llvm::consumeError(contents.takeError());
+            logger::warn("Binary::Binary: Failed to read contents of section at 0x{:x}.", section.getAddress());
+            continue;
+        }
+        if (contents->empty())
+            continue;
+
+        sections.push_back({
+            section.getAddress(),
+            { reinterpret_cast<const uint8_t*>(contents->data()), contents->size() },
+            section,
+            is_executable(*object, section)
+        });
+    }
+    std::sort(sections.begin(), sections.end(), [](const auto& a, const auto& b) { return a.address < b.address; });
+    // Lookups need section ends sorted as well, keep the first of overlapping sections.
+    //
+    for (auto it = sections.begin(); it != sections.end() && std::next(it) != sections.end();)
+    {
+        if (std::next(it)->address < it->end())
+        {
+            logger::warn("Binary::Binary: Ignoring section at 0x{:x} overlapping section at 0x{:x}.", std::next(it)->address, it->address);
+            sections.erase(std::next(it));
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
+
+auto Binary::lower_bound(uint64_t address) const noexcept -> std::vector<Section>::const_iterator
+{
+    return std::upper_bound(sections.begin(), sections.end(), address, [](uint64_t address, const Section& section)
+    {
+        return address < section.end();
+    });
 }
 
 std::optional<llvm::object::SectionRef> Binary::get_section(uint64_t address) const noexcept
 {
-    for (const auto& section : object->sections())
+    if (auto it = lower_bound(address); it != sections.end() && it->address <= address)
     {
-        if (address >= section.getAddress() && address < section.getAddress() + section.getSize())
-        {
-            return section;
-        }
+        return it->section;
     }
     return std::nullopt;
 }
 
+std::span<const uint8_t> Binary::view(uint64_t address) const noexcept
+{
+    if (auto it = lower_bound(address); it != sections.end() && it->address <= address)
+    {
+        return it->contents.subspan(address - it->address);
+    }
+    return {};
+}
+
+std::span<const uint8_t> Binary::view(uint64_t address, size_t size) const noexcept
+{
+    if (auto contents = view(address); contents.size() >= size)
+    {
+        return contents.first(size);
+    }
+    return {};
+}
+
+size_t Binary::read(uint64_t address, std::span<uint8_t> buffer) const noexcept
+{
+    size_t copied{};
+    const auto end = address + buffer.size();
+
+    for (auto it = lower_bound(address); it != sections.end() && it->address < end; it++)
+    {
+        const auto from = std::max(address, it->address);
+        const auto to   = std::min(end, it->end());
+        std::copy(it->contents.begin() + (from - it->address), it->contents.begin() + (to - it->address), buffer.begin() + (from - address));
+        copied += to - from;
+    }
+    return copied;
+}
+
 std::vector<uint8_t> Binary::get_bytes(uint64_t address, size_t size) const noexcept
 {
-    std::vector<uint8_t> raw;
-    if (auto section = get_section(address))
+    std::vector<uint8_t> raw(size);
+    if (auto copied = read(address, raw); copied != size)
     {
-        if (auto offset = address - section->getAddress(); section->getSize() >= offset + size)
+        if (copied != 0)
         {
-            if (auto contents = section->getContents())
-            {
-                for (auto byte : contents->substr(offset, size))
-                {
-                    raw.push_back(byte);
-                }
-            }
-            else
-            {
-                logger::info("Binary::get_bytes: Failed to read {} bytes from 0x{:x}.", size, address);
-            }
-        }
-        else
-        {
-            logger::info("Binary::get_bytes: No offset within section for 0x{:x}:{} was found.", address, size);
+            logger::info("Binary::get_bytes: Only {} of {} bytes from 0x{:x} are backed by sections.", copied, size, address);
         }
+        return {};
     }
     return raw;
 }
 
+auto Binary::code() const noexcept -> std::vector<std::pair<uint64_t, std::span<const uint8_t>>>
+{
+    std::vector<std::pair<uint64_t, std::span<const uint8_t>>> result;
+    for (const auto& section : sections)
+    {
+        if (section.executable)
+            result.emplace_back(section.address, section.contents);
+    }
+    return result;
+}
+
 bool Binary::is_x64() const noexcept
 {
     return object->getArch() == llvm::Triple::ArchType::x86_64;
 }
+
+uint64_t Binary::hash() const noexcept
+{
+    return llvm::xxHash64(memory->getBuffer());
+}
@@ -3,8 +3,10 @@
 #include <llvm/Object/ObjectFile.h>
 #include <llvm/Support/MemoryBuffer.h>
 
+#include <span>
 #include <memory>
 #include <string>
+#include <vector>
 #include <cstdint>
 #include <optional>
 
@@ -21,12 +23,53 @@ struct Binary
         return get_bytes(address, sizeof(T));
     }
 
+    // Contents of the section holding `address` from `address` up to the end of the section.
+    // Points directly into the mapped object, empty if the address is not backed by a section.
+    //
+    auto view(uint64_t address) const noexcept -> std::span<const uint8_t>;
+
+    // Contents of [address, address + size) if the whole range is backed by a single section, empty otherwise.
+    //
+    auto view(uint64_t address, size_t size) const noexcept -> std::span<const uint8_t>;
+
+    // Copy bytes starting at `address` into `buffer`. Reads may cross section boundaries; bytes that are
+    // not backed by any section are left untouched. Returns number of copied bytes.
+    //
+    size_t read(uint64_t address, std::span<uint8_t> buffer) const noexcept;
+
+    // Contents of executable sections as (address, contents) pairs sorted by address.
+    //
+    auto code() const noexcept -> std::vector<std::pair<uint64_t, std::span<const uint8_t>>>;
+
     bool is_x64() const noexcept;
 
+    // Hash of the whole file contents.
+    //
+    uint64_t hash() const noexcept;
+
     auto begin() { return object->section_begin(); }
     auto end()   { return object->section_end();   }
 
 private:
+    struct Section
+    {
+        uint64_t address;
+        std::span<const uint8_t> contents;
+        llvm::object::SectionRef section;
+        bool executable;
+
+        uint64_t end() const noexcept { return address + contents.size(); }
+    };
+
+    // First section whose end lies above `address`: an upper bound over section ends, not a lower bound
+    // over starts. It is the only section that may contain `address`, callers check its start.
+    //
+    auto lower_bound(uint64_t address) const noexcept -> std::vector<Section>::const_iterator;
+
     std::unique_ptr<llvm::object::ObjectFile> object;
     std::unique_ptr<llvm::MemoryBuffer> memory;
+
+    // Sections with contents sorted by address.
+    //
+    std::vector<Section> sections;
 };
@@ -0,0 +1,264 @@
+#include "checkpoint.hpp"
+#include "logger.hpp"
+
+#include <filesystem>
+
+namespace checkpoint
+{
+static constexpr uint64_t magic   = 0x544e50434e415449; // "ITANCPNT"
+static constexpr uint64_t version = 2;
+
+enum class operand_e : uint64_t
+{
+    physical,
+    virtual_register,
+    vsp,
+    immediate
+};
+
+Writer::Writer(std::string path)
+    : path     { std::move(path)    }
+    , temporary{ this->path + ".tmp" }
+    , stream   { temporary, std::ios::binary | std::ios::trunc }
+{
+    if (!stream)
+    {
+        logger::error("checkpoint::Writer: Failed to open {}.", temporary);
+    }
+    write(magic);
+    write(version);
+}
+
+void Writer::write(uint64_t value)
+{
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void Writer::write(const std::string& value)
+{
+    write(value.size());
+    stream.write(value.data(), value.size());
+}
+
+void Writer::write(std::span<const uint8_t> bytes)
+{
+    stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+void Writer::write(const vm::Operand& op)
+{
+    if (op.is_physical())
+    {
+        write(static_cast<uint64_t>(operand_e::physical));
+        write(op.phy().name());
+    }
+    else if (op.is_virtual())
+    {
+        write(static_cast<uint64_t>(operand_e::virtual_register));
+        write(static_cast<uint64_t>(op.vrt().number()));
+        write(static_cast<uint64_t>(op.vrt().offset()));
+    }
+    else if (op.is_vsp())
+    {
+        write(static_cast<uint64_t>(operand_e::vsp));
+    }
+    else
+    {
+        write(static_cast<uint64_t>(operand_e::immediate));
+        write(op.imm().value());
+    }
+}
+
+void Writer::write(const vm::Instruction& insn)
+{
+    write(static_cast<uint64_t>(insn.index()));
+    std::visit([this](const auto& value)
+    {
+        using T = std::decay_t<decltype(value)>;
+        if constexpr (std::is_same_v<T, vm::Push> || std::is_same_v<T, vm::Pop>)
+        {
+            write(static_cast<uint64_t>(value.size()));
+            write(value.op());
+        }
+        else if constexpr (std::is_base_of_v<vm::Sized, T>)
+        {
+            write(static_cast<uint64_t>(value.size()));
+        }
+        else if constexpr (std::is_same_v<T, vm::Exit> || std::is_same_v<T, vm::Enter>)
+        {
+            write(value.regs().size());
+            for (const auto& reg : value.regs())
+            {
+                write(static_cast<uint64_t>(reg.size()));
+                write(reg.op());
+            }
+        }
+        else if constexpr (std::is_same_v<T, vm::Jcc>)
+        {
+            write(static_cast<uint64_t>(value.direction()));
+            write(value.vip_register());
+            write(value.vsp_register());
+        }
+    }, insn);
+}
+
+void Writer::write(const std::vector<vm::Instruction>& insns)
+{
+    write(insns.size());
+    for (const auto& insn : insns)
+        write(insn);
+}
+
+void Writer::write(const Memory::Page& page)
+{
+    const auto [it, inserted] = pages.emplace(&page, pages.size());
+    write(it->second);
+    if (inserted)
+        write(std::span<const uint8_t>(page));
+}
+
+void Writer::commit()
+{
+    stream.close();
+    if (!stream)
+    {
+        logger::error("checkpoint::Writer: Failed to write {}.", temporary);
+    }
+    std::filesystem::rename(temporary, path);
+}
+
+Reader::Reader(const std::string& path)
+    : path  { path                     }
+    , stream{ path, std::ios::binary }
+{
+    if (!stream)
+    {
+        logger::error("checkpoint::Reader: Failed to open {}.", path);
+    }
+    if (read_u64() != magic || read_u64() != version)
+    {
+        logger::error("checkpoint::Reader: {} is not a checkpoint of this version.", path);
+    }
+}
+
+uint64_t Reader::read_u64()
+{
+    uint64_t value{};
+    read({ reinterpret_cast<uint8_t*>(&value), sizeof(value) });
+    return value;
+}
+
+std::string Reader::read_string()
+{
+    std::string value(read_u64(), '\0');
+    read({ reinterpret_cast<uint8_t*>(value.data()), value.size() });
+    return value;
+}
+
+void Reader::read(std::span<uint8_t> bytes)
+{
+    if (!stream.read(reinterpret_cast<char*>(bytes.data()), bytes.size()))
+    {
+        logger::error("checkpoint::Reader: Unexpected end of {}.", path);
+    }
+}
+
+vm::Operand Reader::read_operand()
+{
+    switch (static_cast<operand_e>(read_u64()))
+    {
+    case operand_e::physical:
+        return vm::PhysicalRegister(read_string());
+    case operand_e::virtual_register:
+    {
+        const auto number = static_cast<int>(read_u64());
+        const auto offset = static_cast<int>(read_u64());
+        return vm::VirtualRegister(number, offset);
+    }
+    case operand_e::vsp:
+        return vm::VirtualStackPointer();
+    case operand_e::immediate:
+        return vm::Immediate(read_u64());
+    default:
+        logger::error("checkpoint::Reader: Unknown operand in {}.", path);
+    }
+}
+
+vm::Instruction Reader::read_instruction()
+{
+    const auto index = read_u64();
+    const auto sized = [this]() { return static_cast<int>(read_u64()); };
+    const auto push  = [this]()
+    {
+        const auto size = static_cast<int>(read_u64());
+        return vm::Push(read_operand(), size);
+    };
+    const auto pop   = [this]()
+    {
+        const auto size = static_cast<int>(read_u64());
+        return vm::Pop(read_operand(), size);
+    };
+    switch (index)
+    {
+    case 0:  return vm::Add(sized());
+    case 1:  return vm::Nor(sized());
+    case 2:  return vm::Nand(sized());
+    case 3:  return vm::Shl(sized());
+    case 4:  return vm::Shr(sized());
+    case 5:  return vm::Shrd(sized());
+    case 6:  return vm::Shld(sized());
+    case 7:  return vm::Ldr(sized());
+    case 8:  return vm::Str(sized());
+    case 9:  return push();
+    case 10: return pop();
+    case 11: return vm::Jmp();
+    case 12: return vm::Ret();
+    case 13:
+    {
+        std::vector<vm::Pop> context;
+        for (auto count = read_u64(); count != 0; count--)
+            context.push_back(pop());
+        return vm::Exit(std::move(context));
+    }
+    case 14:
+    {
+        std::vector<vm::Push> context;
+        for (auto count = read_u64(); count != 0; count--)
+            context.push_back(push());
+        return vm::Enter(std::move(context));
+    }
+    case 15:
+    {
+        const auto direction = static_cast<vm::jcc_e>(read_u64());
+        auto vip = read_string();
+        auto vsp = read_string();
+        return vm::Jcc(direction, std::move(vip), std::move(vsp));
+    }
+    default:
+        logger::error("checkpoint::Reader: Unknown instruction {} in {}.", index, path);
+    }
+}
+
+std::shared_ptr<Memory::Page> Reader::read_page()
+{
+    const auto reference = read_u64();
+    if (reference < pages.size())
+        return pages[reference];
+    if (reference != pages.size())
+    {
+        logger::error("checkpoint::Reader: Invalid page reference in {}.", path);
+    }
+    auto page = std::make_shared<Memory::Page>();
+    read(*page);
+    pages.push_back(page);
+    return page;
+}
+
+std::vector<vm::Instruction> Reader::read_instructions()
+{
+    std::vector<vm::Instruction> insns(read_u64(), vm::Jmp());
+    for (auto& insn : insns)
+        insn = read_instruction();
+    return insns;
+}
+};
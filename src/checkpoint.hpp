@@ -0,0 +1,76 @@
+#pragma once
+
+#include "memory.hpp"
+#include "vm/instruction.hpp"
+
+#include <map>
+#include <span>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+
+// Binary checkpoint files of a running exploration. Values are stored in host byte order, a checkpoint
+// is only meant to be resumed by the same build on the same machine.
+//
+namespace checkpoint
+{
+struct Writer
+{
+    // Open temporary file next to `path`. It replaces `path` only once `commit` is called, so a crash
+    // while writing leaves the previous checkpoint intact.
+    //
+    explicit Writer(std::string path);
+
+    void write(uint64_t value);
+    void write(const std::string& value);
+    void write(std::span<const uint8_t> bytes);
+    void write(const vm::Instruction& insn);
+    void write(const std::vector<vm::Instruction>& insns);
+
+    // Write contents of a page once. Pages are shared copy-on-write between snapshots, later writes of
+    // the same page only store a reference to it.
+    //
+    void write(const Memory::Page& page);
+
+    void commit();
+
+private:
+    void write(const vm::Operand& op);
+
+    std::string path;
+    std::string temporary;
+    std::ofstream stream;
+
+    // Reference of every page written so far.
+    //
+    std::map<const Memory::Page*, uint64_t> pages;
+};
+
+struct Reader
+{
+    explicit Reader(const std::string& path);
+
+    uint64_t            read_u64();
+    std::string         read_string();
+    void                read(std::span<uint8_t> bytes);
+    vm::Instruction     read_instruction();
+    std::vector<vm::Instruction> read_instructions();
+
+    // Read page written by `Writer::write(const Memory::Page&)`. Pages referenced several times are
+    // returned shared.
+    //
+    std::shared_ptr<Memory::Page> read_page();
+
+private:
+    vm::Operand read_operand();
+
+    std::string path;
+    std::ifstream stream;
+
+    // Pages read so far by reference.
+    //
+    std::vector<std::shared_ptr<Memory::Page>> pages;
+};
+};
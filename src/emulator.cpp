@@ -9,8 +9,17 @@ using namespace triton::arch;
 using namespace triton::arch::x86;
 
 Emulator::Emulator(triton::arch::architecture_e arch) noexcept
+    : Emulator(arch, std::make_shared<Binary>())
+{
+}
+
+Emulator::Emulator(triton::arch::architecture_e arch, std::shared_ptr<Binary> image) noexcept
     : Context(arch)
-    , image{ std::make_shared<Binary>() }
+    , image  { image }
+    , memory { image }
+    , decoded{ std::make_shared<DecodedCache>() }
+    , last_mapped{ ~0ull }
+    , checkpoints{ 0 }
 {
     setMode(modes::MEMORY_ARRAY, false);
     setMode(modes::ALIGNED_MEMORY, true);
@@ -23,11 +32,39 @@ Emulator::Emulator(triton::arch::architecture_e arch) noexcept
     concretizeAllMemory();
     concretizeAllRegister();
 
+    // Memory is paged into the context from the page store, which falls back to the image, one page at a time
+    // on first touch. Reads from already mapped pages only cost a lookup.
+    //
     auto get_memory_cb = [this](triton::Context& context, const triton::arch::MemoryAccess& memory)
     {
-        if (!context.isConcreteMemoryValueDefined(memory.getAddress(), memory.getSize()))
+        const auto first = Memory::page_index(memory.getAddress());
+        const auto last  = Memory::page_index(memory.getAddress() + memory.getSize() - 1);
+        for (auto index = first; index <= last; index++)
+        {
+            map_page(index);
+        }
+    };
+    // Mirror every write into the page store so snapshots can share it. The page store is never older
+    // than the context, so previous bytes for the journal are taken from it.
+    //
+    auto set_memory_cb = [this](triton::Context& context, const triton::arch::MemoryAccess& memory, const triton::uint512& value)
+    {
+        std::vector<uint8_t> bytes(memory.getSize());
+        for (size_t i = 0; i < bytes.size(); i++)
+        {
+            bytes[i] = static_cast<uint8_t>(static_cast<uint64_t>((value >> (8 * i)) & 0xff));
+        }
+        if (checkpoints != 0)
+        {
+            journal.emplace_back(MemoryWrite{ memory.getAddress(), this->memory.read(memory.getAddress(), memory.getSize()) });
+        }
+        this->memory.write(memory.getAddress(), bytes);
+    };
+    auto set_register_cb = [this](triton::Context& context, const triton::arch::Register& reg, const triton::uint512& value)
+    {
+        if (checkpoints != 0)
         {
-            context.setConcreteMemoryAreaValue(memory.getAddress(), this->image->get_bytes(memory.getAddress(), memory.getSize()));
+            journal.emplace_back(RegisterWrite{ reg, context.getConcreteRegisterValue(reg, false) });
         }
     };
 
@@ -35,17 +72,187 @@ Emulator::Emulator(triton::arch::architecture_e arch) noexcept
         triton::callbacks::callback_e::GET_CONCRETE_MEMORY_VALUE,
         triton::callbacks::getConcreteMemoryValueCallback{ get_memory_cb, &get_memory_cb }
     );
+    addCallback(
+        triton::callbacks::callback_e::SET_CONCRETE_MEMORY_VALUE,
+        triton::callbacks::setConcreteMemoryValueCallback{ set_memory_cb, &set_memory_cb }
+    );
+    addCallback(
+        triton::callbacks::callback_e::SET_CONCRETE_REGISTER_VALUE,
+        triton::callbacks::setConcreteRegisterValueCallback{ set_register_cb, &set_register_cb }
+    );
 }
 
 Emulator::Emulator(Emulator const& other) noexcept
-    : Emulator(other.getArchitecture())
+    : Emulator(other.getArchitecture(), other.image)
+{
+    assign(other);
+}
+
+void Emulator::reset(std::shared_ptr<Binary> image) noexcept
+{
+    // Engines are kept, expressions of the previous user go with the concretization. Its symbolic
+    // variables stay, callers bound them with `reset_engines`.
+    //
+    clearArchitecture();
+    concretizeAllRegister();
+    concretizeAllMemory();
+
+    this->image = image;
+    memory      = Memory(image);
+    last_mapped = ~0ull;
+    checkpoints = 0;
+    mapped.clear();
+    journal.clear();
+}
+
+void Emulator::reset_engines() noexcept
+{
+    std::vector<std::pair<Register, triton::uint512>> values;
+    for (const auto reg : getParentRegisters())
+        values.emplace_back(*reg, getConcreteRegisterValue(*reg, false));
+
+    setArchitecture(getArchitecture());
+    // Registers are restored without callbacks, they do not change and must not be journaled. Memory is
+    // paged in again from the page store, which mirrors every write of the context.
+    //
+    for (const auto& [reg, value] : values)
+        setConcreteRegisterValue(reg, value, false);
+    last_mapped = ~0ull;
+    mapped.clear();
+}
+
+void Emulator::assign(Emulator const& other) noexcept
 {
     for (const auto& [reg_e, reg] : other.getAllRegisters())
         setConcreteRegisterValue(reg, other.getConcreteRegisterValue(reg));
+    // Memory is populated lazily from the shared pages on first read.
+    //
+    memory  = other.memory;
+    decoded = other.decoded;
+}
+
+void Emulator::save(checkpoint::Writer& writer) const
+{
+    const auto regs = getParentRegisters();
+    writer.write(regs.size());
+    for (const auto reg : regs)
+    {
+        const auto value = getConcreteRegisterValue(*reg);
+        writer.write(reg->getName());
+        for (size_t i = 0; i < 8; i++)
+        {
+            writer.write(static_cast<uint64_t>((value >> (64 * i)) & 0xffffffffffffffffull));
+        }
+    }
+    writer.write(static_cast<uint64_t>(std::distance(memory.begin(), memory.end())));
+    for (const auto& [index, page] : memory)
+    {
+        writer.write(index);
+        writer.write(*page);
+    }
+}
+
+void Emulator::load(checkpoint::Reader& reader)
+{
+    for (auto count = reader.read_u64(); count != 0; count--)
+    {
+        const auto& reg = getRegister(reader.read_string());
+        triton::uint512 value{};
+        for (size_t i = 0; i < 8; i++)
+        {
+            value |= triton::uint512(reader.read_u64()) << (64 * i);
+        }
+        setConcreteRegisterValue(reg, value);
+    }
+    for (auto count = reader.read_u64(); count != 0; count--)
+    {
+        const auto index = reader.read_u64();
+        memory.share(index, reader.read_page());
+    }
+}
 
-    for (const auto& [addr, value] : other.getConcreteMemory())
-        setConcreteMemoryValue(addr, value);
-    image = other.image;
+void Emulator::map_page(uint64_t index)
+{
+    if (index == last_mapped)
+        return;
+    last_mapped = index;
+
+    if (!mapped.insert(index).second)
+        return;
+    // Bytes are set without callbacks so mapping does not dirty the page. Writes of this context are
+    // mirrored into the page store, so the page store copy is never older than the context. They go to
+    // the cpu directly: the context would also concretize memory, dropping symbolic values written to
+    // the page before its first read, e.g. registers pushed by vmenter onto a fresh stack page.
+    //
+    const auto base = index * Memory::page_size;
+    auto cpu        = getCpuInstance();
+    if (auto page = memory.page(base))
+    {
+        cpu->setConcreteMemoryAreaValue(base, page->data(), page->size(), false);
+    }
+    else
+    {
+        std::vector<uint8_t> bytes(Memory::page_size);
+        if (image->read(base, bytes) != 0)
+        {
+            cpu->setConcreteMemoryAreaValue(base, bytes, false);
+        }
+    }
+}
+
+Emulator::Checkpoint::Checkpoint(Emulator& emulator) noexcept
+    : emulator{ emulator                }
+    , mark    { emulator.journal.size() }
+    , open    { true                    }
+{
+    emulator.checkpoints++;
+}
+
+Emulator::Checkpoint::~Checkpoint()
+{
+    if (open)
+        rollback();
+}
+
+void Emulator::Checkpoint::commit() noexcept
+{
+    open = false;
+    // Writes stay in the journal for enclosing scopes, which may still roll them back.
+    //
+    if (--emulator.checkpoints == 0)
+        emulator.journal.clear();
+}
+
+void Emulator::Checkpoint::rollback() noexcept
+{
+    open = false;
+    emulator.undo(mark);
+    if (--emulator.checkpoints == 0)
+        emulator.journal.clear();
+}
+
+void Emulator::undo(size_t mark) noexcept
+{
+    // Restore in reverse order so overlapping writes end up with the oldest value. Restoring does not
+    // run callbacks, the page store is restored explicitly.
+    //
+    while (journal.size() > mark)
+    {
+        std::visit([this](const auto& entry)
+        {
+            using T = std::decay_t<decltype(entry)>;
+            if constexpr (std::is_same_v<T, RegisterWrite>)
+            {
+                setConcreteRegisterValue(entry.reg, entry.value, false);
+            }
+            else
+            {
+                setConcreteMemoryAreaValue(entry.address, entry.bytes, false);
+                memory.write(entry.address, entry.bytes);
+            }
+        }, journal.back());
+        journal.pop_back();
+    }
 }
 
 uint64_t Emulator::read(const triton::arch::Register& reg) const noexcept
@@ -119,13 +326,45 @@ std::set<triton::arch::Register> Emulator::regs() const noexcept
 triton::arch::Instruction Emulator::disassemble() const noexcept
 {
     auto curr_pc = rip();
-    auto bytes   = getConcreteMemoryAreaValue(curr_pc, 16);
+    // Code on pages written by this emulator may differ from the image, it is never cached.
+    //
+    const auto pristine = memory.page(curr_pc) == nullptr && memory.page(curr_pc + 15) == nullptr;
+    if (pristine)
+    {
+        Instruction insn;
+        if (decoded->find(curr_pc, insn))
+            return insn;
+    }
+    auto bytes = getConcreteMemoryAreaValue(curr_pc, 16);
 
     Instruction insn(curr_pc, bytes.data(), bytes.size());
     disassembly(insn);
+    if (pristine)
+    {
+        decoded->insert(insn);
+    }
     return insn;
 }
 
+bool Emulator::DecodedCache::find(uint64_t address, triton::arch::Instruction& insn) const
+{
+    const auto& shard = shards[shard_index(address)];
+    std::shared_lock guard(shard.lock);
+    if (auto it = shard.insns.find(address); it != shard.insns.end())
+    {
+        insn = it->second;
+        return true;
+    }
+    return false;
+}
+
+void Emulator::DecodedCache::insert(const triton::arch::Instruction& insn)
+{
+    auto& shard = shards[shard_index(insn.getAddress())];
+    std::unique_lock guard(shard.lock);
+    shard.insns.emplace(insn.getAddress(), insn);
+}
+
 triton::arch::Instruction Emulator::single_step()
 {
     auto insn = disassemble();
@@ -140,3 +379,35 @@ void Emulator::execute(triton::arch::Instruction& insn)
         logger::error("Emulator::execute: Failed to execute instruction at 0x{:x}.", rip());
     }
 }
+
+void Emulator::execute_concrete(triton::arch::Instruction& insn)
+{
+    // Toggling the symbolic engine off makes Triton back up and restore the whole engine for every
+    // instruction. Only symbolized operands get expressions instead; semantics of concrete operands are
+    // evaluated and the result stored as a concrete value, without creating symbolic expressions.
+    //
+    setMode(modes::ONLY_ON_SYMBOLIZED, true);
+    try
+    {
+        execute(insn);
+    }
+    catch (...)
+    {
+        setMode(modes::ONLY_ON_SYMBOLIZED, false);
+        throw;
+    }
+    setMode(modes::ONLY_ON_SYMBOLIZED, false);
+    // Operands derived from symbolic values still got expressions, drop them so that written operands
+    // hold their new concrete values only.
+    //
+    for (const auto& [reg, node] : insn.getWrittenRegisters())
+    {
+        if (isRegisterSymbolized(reg))
+            concretizeRegister(reg);
+    }
+    for (const auto& [mem, node] : insn.getStoreAccess())
+    {
+        if (isMemorySymbolized(mem))
+            concretizeMemory(mem);
+    }
+}
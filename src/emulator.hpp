@@ -1,9 +1,17 @@
 #pragma once
 
 #include "binary.hpp"
+#include "memory.hpp"
+#include "checkpoint.hpp"
 
 #include <functional>
+#include <array>
+#include <mutex>
+#include <shared_mutex>
 #include <optional>
+#include <variant>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <triton/context.hpp>
 #include <triton/basicBlock.hpp>
@@ -12,9 +20,16 @@
 struct Emulator : public triton::Context
 {
     explicit Emulator(triton::arch::architecture_e arch) noexcept;
+    explicit Emulator(triton::arch::architecture_e arch, std::shared_ptr<Binary> image) noexcept;
 
+    // Copy registers and share memory pages with `other`. Pages are copied lazily on write.
+    //
     Emulator(Emulator const& other) noexcept;
 
+    // Image the emulated memory falls back to.
+    //
+    const Binary& binary() const noexcept { return *image; }
+
     uint64_t ptrsize() const noexcept;
     // Most used registers getters.
     //
@@ -55,6 +70,114 @@ struct Emulator : public triton::Context
 
     void execute(triton::arch::Instruction& insn);
 
+    // Execute instruction without creating symbolic expressions for concrete operands and concretize the
+    // registers and memory it writes, so no expressions are kept for the instruction. ASTs of the
+    // semantics are still built, Triton evaluates them to get the concrete values.
+    //
+    void execute_concrete(triton::arch::Instruction& insn);
+
+    // Scope recording register and memory writes of the emulator. Writes are kept with `commit` or
+    // undone in O(writes) with `rollback`; a scope left without either, e.g. by an exception, rolls
+    // back. Scopes nest, writes are recorded until the outermost one is closed.
+    //
+    struct Checkpoint
+    {
+        explicit Checkpoint(Emulator& emulator) noexcept;
+        ~Checkpoint();
+
+        Checkpoint(const Checkpoint&) = delete;
+        Checkpoint& operator=(const Checkpoint&) = delete;
+
+        void commit() noexcept;
+        void rollback() noexcept;
+
+    private:
+        Emulator& emulator;
+        size_t mark;
+        bool open;
+    };
+
+    // Store registers and written pages. `load` expects an emulator in its initial state.
+    //
+    void save(checkpoint::Writer& writer) const;
+    void load(checkpoint::Reader& reader);
+
 protected:
+    // Bring the context back to its initial state: zero registers, no symbolic expressions and memory
+    // backed by `image` only. Engines, modes and callbacks are kept, so the context can be reused right
+    // away. Symbolic variables of the previous user are kept as well.
+    //
+    void reset(std::shared_ptr<Binary> image) noexcept;
+
+    // Recreate the engines to drop every symbolic variable and expression while keeping concrete state.
+    //
+    void reset_engines() noexcept;
+
+    // Copy registers of `other` and share its memory pages and decoded instructions.
+    //
+    void assign(Emulator const& other) noexcept;
+
+    // Copy page from the page store or the image into the context on first touch.
+    //
+    void map_page(uint64_t index);
+
     std::shared_ptr<Binary> image;
+
+    // Copy-on-write store of every byte written by this emulator or its parents.
+    //
+    Memory memory;
+
+    // Decoded instructions of unmodified image code by address. Shared by all copies of the emulator,
+    // which may run on different threads. Addresses are spread over shards with reader-writer locks, so
+    // lookups of concurrent tracers neither block each other nor share one lock.
+    //
+    struct DecodedCache
+    {
+        // Copy decoded instruction at `address` into `insn`, false if it is not cached.
+        //
+        bool find(uint64_t address, triton::arch::Instruction& insn) const;
+        void insert(const triton::arch::Instruction& insn);
+
+    private:
+        struct Shard
+        {
+            mutable std::shared_mutex lock;
+            std::unordered_map<uint64_t, triton::arch::Instruction> insns;
+        };
+        static constexpr size_t shard_count = 16;
+
+        static size_t shard_index(uint64_t address) noexcept
+        {
+            return (address * 0x9e3779b97f4a7c15ull) >> 60;
+        }
+
+        std::array<Shard, shard_count> shards;
+    };
+    std::shared_ptr<DecodedCache> decoded;
+
+    // Indices of pages already copied into the context and the last one touched.
+    //
+    std::unordered_set<uint64_t> mapped;
+    uint64_t last_mapped;
+
+private:
+    struct RegisterWrite
+    {
+        triton::arch::Register reg;
+        triton::uint512 value;
+    };
+    struct MemoryWrite
+    {
+        uint64_t address;
+        std::vector<uint8_t> bytes;
+    };
+
+    // Previous values of everything written since the outermost checkpoint.
+    //
+    // Undo journaled writes down to `mark`.
+    //
+    void undo(size_t mark) noexcept;
+
+    std::vector<std::variant<RegisterWrite, MemoryWrite>> journal;
+    size_t checkpoints;
 };
@@ -3,25 +3,102 @@
 #include "il/solver.hpp"
 #include "asserts.hpp"
 #include "utils.hpp"
+#include "checkpoint.hpp"
+
+#include <llvm/Support/CommandLine.h>
+
+#include <chrono>
+#include <filesystem>
+
+llvm::cl::opt<unsigned> tracing_threads("threads",
+    llvm::cl::desc("Number of threads tracing blocks, 0 uses all hardware threads"),
+    llvm::cl::value_desc("threads"),
+    llvm::cl::init(0),
+    llvm::cl::Optional);
+
+llvm::cl::opt<unsigned> trace_queue("trace-queue",
+    llvm::cl::desc("Maximum number of blocks traced ahead of the exploration"),
+    llvm::cl::value_desc("blocks"),
+    llvm::cl::init(64),
+    llvm::cl::Optional);
+
+llvm::cl::opt<std::string> checkpoint_path("checkpoint",
+    llvm::cl::desc("Path prefix of the exploration checkpoint files, the entrypoint is appended"),
+    llvm::cl::value_desc("path"),
+    llvm::cl::init(""),
+    llvm::cl::Optional);
+
+llvm::cl::opt<unsigned> checkpoint_interval("checkpoint-interval",
+    llvm::cl::desc("Seconds between exploration checkpoints"),
+    llvm::cl::value_desc("seconds"),
+    llvm::cl::init(300),
+    llvm::cl::Optional);
+
+llvm::cl::opt<std::string> cache_dir("cache",
+    llvm::cl::desc("Directory of the persistent block functions cache"),
+    llvm::cl::value_desc("directory"),
+    llvm::cl::init(""),
+    llvm::cl::Optional);
+
+llvm::cl::opt<bool> resume("resume",
+    llvm::cl::desc("Continue exploration from the checkpoint files that exist"),
+    llvm::cl::init(false),
+    llvm::cl::Optional);
 
 static constexpr auto stack_base = 0x10000;
 
+// Checkpoints of different routines of a batch are kept apart.
+//
+static std::string checkpoint_file(uint64_t entrypoint)
+{
+    return fmt::format("{}.0x{:x}", checkpoint_path.getValue(), entrypoint);
+}
+
+// Step tracer until the virtual instruction that ends the block. The tracer is left in front of
+// the branch, the same way the explorer leaves it when stepping by itself.
+//
+static std::vector<vm::Instruction> trace_block(const std::shared_ptr<Tracer>& tracer)
+{
+    std::vector<vm::Instruction> trace;
+    do
+    {
+        trace.push_back(tracer->step(step_t::stop_before_branch));
+    }
+    while (!vm::op_branch(trace.back()) && !std::holds_alternative<vm::Ret>(trace.back()));
+    return trace;
+}
+
 Explorer::Explorer(std::shared_ptr<Lifter> lifter, std::shared_ptr<Tracer> tracer)
-    : lifter(lifter), tracer(tracer), block(nullptr), terminate(false)
+    : lifter(lifter), tracer(tracer), workers(llvm::hardware_concurrency(tracing_threads)), block(nullptr), terminate(false)
 {
 }
 
 std::unique_ptr<vm::Routine> Explorer::explore(uint64_t address)
 {
-    tracer->write(tracer->rip_register(), address);
-    tracer->write(tracer->rsp_register(), stack_base);
+    const auto entrypoint = address;
+    // Warm run, every block function of the routine is cached.
+    //
+    if (!cache_dir.empty() && load_cache(entrypoint))
+    {
+        return std::unique_ptr<vm::Routine>{ block->owner };
+    }
+    if (resume && !checkpoint_path.empty() && std::filesystem::exists(checkpoint_file(entrypoint)))
+    {
+        restore(entrypoint);
+    }
+    else
+    {
+        tracer->write(tracer->rip_register(), address);
+        tracer->write(tracer->rsp_register(), stack_base);
 
-    block = vm::Routine::begin(address);
+        block = vm::Routine::begin(address);
 
-    std::visit(*this, tracer->step(step_t::stop_before_branch));
+        std::visit(*this, tracer->step(step_t::stop_before_branch));
 
-    worklist.push(address);
-    snapshots.emplace(address, std::move(tracer));
+        snapshots.emplace(address, std::move(tracer));
+        enqueue(address);
+    }
+    auto last_checkpoint = std::chrono::steady_clock::now();
 
     while (!worklist.empty())
     {
@@ -44,14 +121,14 @@ std::unique_ptr<vm::Routine> Explorer::explore(uint64_t address)
         }
 
         logger::debug("exploring 0x{:x}", address);
-
-        while (!terminate)
+        // Blocks are traced concurrently but processed in worklist order, so the routine does not
+        // depend on the order the workers finish in.
+        //
+        for (auto& vinsn : take_trace(address))
         {
-            // logger::info("execute: 0x{:x}", tracer->rip());
-            // Process instruction.
-            //
-            std::visit(*this, tracer->step(step_t::stop_before_branch));
+            std::visit(*this, std::move(vinsn));
         }
+        fassert(terminate);
         terminate = false;
 
         for (const auto& reprove : get_reprove_blocks())
@@ -60,6 +137,22 @@ std::unique_ptr<vm::Routine> Explorer::explore(uint64_t address)
             worklist.push(reprove);
             explored.erase(reprove);
         }
+
+        if (!checkpoint_path.empty() && std::chrono::steady_clock::now() - last_checkpoint >= std::chrono::seconds(checkpoint_interval))
+        {
+            save(entrypoint);
+            last_checkpoint = std::chrono::steady_clock::now();
+        }
+    }
+    // Do not leave workers running on snapshots after exploration.
+    //
+    workers.wait();
+    traces.clear();
+    untraced.clear();
+
+    if (!cache_dir.empty())
+    {
+        store_cache(entrypoint);
     }
     return std::unique_ptr<vm::Routine>{ block->owner };
 }
@@ -142,8 +235,8 @@ void Explorer::operator()(vm::Jmp&& insn)
     //
     auto vip = tracer->vip();
     block->fork(vip);
-    worklist.push(vip);
     snapshots.emplace(vip, tracer->fork());
+    enqueue(vip);
     // Terminate current block.
     //
     terminate = true;
@@ -178,13 +271,14 @@ void Explorer::operator()(vm::Jcc&& insn)
 
         auto fork = tracer->fork();
         fork->write(fork->vsp(), target - (insn.direction() == vm::jcc_e::up ? 1 : -1) * 4);
-        // Execute branch instruction.
+        // Execute branch instruction. The handler was classified by the current tracer already,
+        // so the fork replays it from the handlers cache with concrete execution only.
         //
         fork->step(step_t::execute_branch);
 
         block->fork(target);
-        worklist.push(target);
         snapshots.insert({ target, std::move(fork) });
+        enqueue(target);
     }
     // Terminate current block.
     //
@@ -224,14 +318,16 @@ void Explorer::operator()(vm::Exit&& insn)
         {
             if (auto cint = llvm::dyn_cast<llvm::ConstantInt>(gep->getOperand(gep->getNumOperands() - 1)))
             {
-                lifter->create_external_call(block->lifted, fmt::format("External.0x{:x}", cint->getLimitedValue()));
+                external_calls[block->vip()] = fmt::format("External.0x{:x}", cint->getLimitedValue());
+                lifter->create_external_call(block->lifted, external_calls.at(block->vip()));
                 il::optimize_block_function(block->lifted);
             }
         }
     }
     else if (auto cint = llvm::dyn_cast<llvm::ConstantInt>(args.program_counter()))
     {
-        lifter->create_external_call(block->lifted, fmt::format("External.0x{:x}", cint->getLimitedValue()));
+        external_calls[block->vip()] = fmt::format("External.0x{:x}", cint->getLimitedValue());
+        lifter->create_external_call(block->lifted, external_calls.at(block->vip()));
         il::optimize_block_function(block->lifted);
     }
 
@@ -239,13 +335,13 @@ void Explorer::operator()(vm::Exit&& insn)
     {
         auto address = cint->getLimitedValue();
         logger::info("Continue vm execution from 0x{:x}", address);
-        tracer = std::make_shared<Tracer>(tracer->getArchitecture());
+        tracer = tracer->spawn();
         tracer->write(tracer->rip_register(), address);
         tracer->write(tracer->rsp_register(), stack_base);
 
         block->fork(address);
-        worklist.push(address);
         snapshots.insert({ address, std::move(tracer) });
+        enqueue(address);
     }
     // Terminate current block.
     //
@@ -287,8 +383,8 @@ void Explorer::reprove_block()
             fork->step(step_t::execute_branch);
 
             block->fork(target);
-            worklist.push(target);
             snapshots.insert({ target, std::move(fork) });
+            enqueue(target);
         }
     }
 
@@ -313,3 +409,277 @@ std::set<uint64_t> Explorer::get_reprove_blocks()
     fill(block, fill);
     return reprove;
 }
+
+void Explorer::enqueue(uint64_t address)
+{
+    worklist.push(address);
+    // Start tracing right away so workers trace the block while the exploring thread lifts and
+    // solves the current one.
+    //
+    if (!should_trace(address))
+        return;
+    if (traces.size() < trace_queue)
+        start_trace(address);
+    else
+        untraced.push_back(address);
+}
+
+bool Explorer::should_trace(uint64_t address) const
+{
+    // Explored and lifted blocks are not traced again when popped.
+    //
+    return !traces.contains(address)
+        && !explored.contains(address)
+        && block->owner->blocks.at(address)->lifted == nullptr;
+}
+
+void Explorer::start_trace(uint64_t address)
+{
+    traces.emplace(address, workers.async([tracer = snapshots.at(address)->fork()]
+    {
+        return Trace{ tracer, trace_block(tracer) };
+    }));
+}
+
+void Explorer::fill_traces()
+{
+    // Most recently queued blocks are popped from the worklist first. Entries that were traced or
+    // explored meanwhile are dropped, so every address is looked at once.
+    //
+    while (!untraced.empty() && traces.size() < trace_queue)
+    {
+        const auto address = untraced.back();
+        untraced.pop_back();
+        if (should_trace(address))
+            start_trace(address);
+    }
+}
+
+std::vector<vm::Instruction> Explorer::take_trace(uint64_t address)
+{
+    if (!traces.contains(address))
+    {
+        start_trace(address);
+    }
+    auto trace = traces.extract(address);
+    // Keep workers busy while this block is lifted.
+    //
+    fill_traces();
+    const auto& result = trace.mapped().get();
+    tracer             = result.tracer;
+    snapshots[address] = tracer;
+    return result.insns;
+}
+
+void Explorer::save(uint64_t entrypoint)
+{
+    checkpoint::Writer writer(checkpoint_file(entrypoint));
+    writer.write(entrypoint);
+    write_routine(writer);
+    // Worklist from bottom to top.
+    //
+    std::vector<uint64_t> pending;
+    for (auto copy = worklist; !copy.empty(); copy.pop())
+        pending.push_back(copy.top());
+    writer.write(pending.size());
+    for (auto it = pending.rbegin(); it != pending.rend(); it++)
+        writer.write(*it);
+
+    writer.write(explored.size());
+    for (const auto vip : explored)
+        writer.write(vip);
+    // Workers trace forks, so snapshots are stable. A finished trace is stored with the tracer it left
+    // past the block, blocks whose trace is not finished yet keep the snapshot from their start.
+    //
+    std::map<uint64_t, const Trace*> finished;
+    for (const auto& [vip, trace] : traces)
+    {
+        if (trace.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            finished.emplace(vip, &trace.get());
+    }
+    writer.write(snapshots.size());
+    for (const auto& [vip, snapshot] : snapshots)
+    {
+        writer.write(vip);
+        if (auto it = finished.find(vip); it != finished.end())
+            it->second->tracer->save(writer);
+        else
+            snapshot->save(writer);
+    }
+    writer.write(finished.size());
+    for (const auto& [vip, trace] : finished)
+    {
+        writer.write(vip);
+        writer.write(trace->insns);
+    }
+    writer.commit();
+    logger::info("checkpoint: {} blocks, {} pending", block->owner->blocks.size(), pending.size());
+}
+
+void Explorer::restore(uint64_t entrypoint)
+{
+    checkpoint::Reader reader(checkpoint_file(entrypoint));
+    if (reader.read_u64() != entrypoint)
+    {
+        logger::error("Explorer::restore: Checkpoint {} belongs to another entrypoint.", checkpoint_file(entrypoint));
+    }
+    auto lifted = read_routine(reader, entrypoint);
+    // Block functions are not stored, lift them again.
+    //
+    std::vector<llvm::Function*> functions;
+    for (auto bb : lifted)
+    {
+        bb->lifted = lifter->lift_basic_block(bb);
+        functions.push_back(bb->lifted);
+    }
+    il::optimize_block_functions(functions);
+
+    functions.clear();
+    for (auto bb : lifted)
+    {
+        if (external_calls.contains(bb->vip()))
+        {
+            lifter->create_external_call(bb->lifted, external_calls.at(bb->vip()));
+            functions.push_back(bb->lifted);
+        }
+    }
+    il::optimize_block_functions(functions);
+    for (auto count = reader.read_u64(); count != 0; count--)
+    {
+        worklist.push(reader.read_u64());
+        untraced.push_back(worklist.top());
+    }
+    for (auto count = reader.read_u64(); count != 0; count--)
+        explored.insert(reader.read_u64());
+    for (auto count = reader.read_u64(); count != 0; count--)
+    {
+        const auto vip = reader.read_u64();
+        auto snapshot  = tracer->spawn();
+        snapshot->load(reader);
+        snapshots.emplace(vip, std::move(snapshot));
+    }
+    for (auto count = reader.read_u64(); count != 0; count--)
+    {
+        const auto vip = reader.read_u64();
+        std::promise<Trace> trace;
+        trace.set_value(Trace{ snapshots.at(vip), reader.read_instructions() });
+        traces.emplace(vip, trace.get_future().share());
+    }
+    logger::info("resumed from checkpoint: {} blocks, {} pending", block->owner->blocks.size(), worklist.size());
+}
+
+void Explorer::write_routine(checkpoint::Writer& writer) const
+{
+    std::map<uint64_t, const vm::BasicBlock*> blocks(block->owner->begin(), block->owner->end());
+    writer.write(blocks.size());
+    for (const auto& [vip, bb] : blocks)
+    {
+        writer.write(vip);
+        writer.write(static_cast<uint64_t>(bb->lifted != nullptr));
+        writer.write(external_calls.contains(vip) ? external_calls.at(vip) : "");
+        writer.write(std::vector<vm::Instruction>(bb->begin(), bb->end()));
+        writer.write(bb->next.size());
+        for (const auto next : bb->next)
+            writer.write(next->vip());
+    }
+}
+
+std::vector<vm::BasicBlock*> Explorer::read_routine(checkpoint::Reader& reader, uint64_t entrypoint)
+{
+    // Blocks are created first, edges are linked once every block exists.
+    //
+    block = vm::Routine::begin(entrypoint);
+    auto routine = block->owner;
+
+    std::vector<std::pair<vm::BasicBlock*, std::vector<uint64_t>>> edges;
+    std::vector<vm::BasicBlock*> lifted;
+    for (auto count = reader.read_u64(); count != 0; count--)
+    {
+        const auto vip = reader.read_u64();
+        auto bb = routine->contains(vip) ? routine->blocks.at(vip) : new vm::BasicBlock(vip, routine);
+        if (reader.read_u64() != 0)
+            lifted.push_back(bb);
+        if (auto name = reader.read_string(); !name.empty())
+            external_calls.emplace(vip, std::move(name));
+        for (auto& insn : reader.read_instructions())
+            bb->add(std::move(insn));
+
+        auto& [_, next] = edges.emplace_back(bb, std::vector<uint64_t>(reader.read_u64()));
+        for (auto& target : next)
+            target = reader.read_u64();
+    }
+    for (const auto& [bb, next] : edges)
+    {
+        for (const auto vip : next)
+            bb->link(routine->blocks.at(vip));
+    }
+    return lifted;
+}
+
+// Block functions of every cached routine are linked into one module, names are unique per entrypoint.
+//
+static std::string cached_name(uint64_t entrypoint, uint64_t vip)
+{
+    return fmt::format("cached.0x{:x}.bb_0x{:x}", entrypoint, vip);
+}
+
+std::string Explorer::cache_entry(uint64_t entrypoint) const
+{
+    return (std::filesystem::path(cache_dir.getValue()) / fmt::format("{:016x}-{:016x}-{:x}", tracer->binary().hash(), lifter->intrinsics_hash(), entrypoint)).string();
+}
+
+bool Explorer::load_cache(uint64_t entrypoint)
+{
+    const auto entry = cache_entry(entrypoint);
+    if (!std::filesystem::exists(entry + ".routine") || !std::filesystem::exists(entry + ".bc"))
+        return false;
+
+    auto functions = lifter->load_functions(entry + ".bc");
+    if (functions.empty())
+    {
+        logger::warn("Failed to load cached block functions from {}.bc", entry);
+        return false;
+    }
+    checkpoint::Reader reader(entry + ".routine");
+    for (auto bb : read_routine(reader, entrypoint))
+    {
+        // Files of the pair are written one after another, an interrupted store leaves them mismatched.
+        // Everything read so far is dropped and the routine is explored as on a miss.
+        //
+        auto it = functions.find(cached_name(entrypoint, bb->vip()));
+        if (it == functions.end())
+        {
+            logger::warn("Cached block functions in {}.bc do not match the routine.", entry);
+            for (const auto& [name, fn] : functions)
+                fn->dropAllReferences();
+            for (const auto& [name, fn] : functions)
+                fn->eraseFromParent();
+            delete block->owner;
+            block = nullptr;
+            external_calls.clear();
+            return false;
+        }
+        bb->lifted = it->second;
+    }
+    logger::info("loaded {} blocks from cache {}", block->owner->blocks.size(), entry);
+    return true;
+}
+
+void Explorer::store_cache(uint64_t entrypoint) const
+{
+    std::filesystem::create_directories(cache_dir.getValue());
+
+    const auto entry = cache_entry(entrypoint);
+    std::map<std::string, llvm::Function*> functions;
+    for (const auto& [vip, bb] : *block->owner)
+    {
+        if (bb->lifted != nullptr)
+            functions.emplace(cached_name(entrypoint, vip), bb->lifted);
+    }
+    if (!lifter->save_functions(functions, entry + ".bc"))
+        return;
+
+    checkpoint::Writer writer(entry + ".routine");
+    write_routine(writer);
+    writer.commit();
+}
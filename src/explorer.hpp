@@ -4,8 +4,12 @@
 
 #include "lifter.hpp"
 #include "tracer.hpp"
+#include "checkpoint.hpp"
+
+#include <llvm/Support/ThreadPool.h>
 
 #include <stack>
+#include <future>
 
 struct Explorer
 {
@@ -35,6 +39,57 @@ private:
 
     std::set<uint64_t> get_reprove_blocks();
 
+    // Push block to the worklist and start tracing it if the trace queue is not full.
+    //
+    void enqueue(uint64_t address);
+
+    // Block is neither traced, explored nor lifted.
+    //
+    bool should_trace(uint64_t address) const;
+
+    // Trace fork of the block snapshot on a worker, the snapshot itself stays at the block start.
+    //
+    void start_trace(uint64_t address);
+
+    // Start tracing worklist blocks until the trace queue is full.
+    //
+    void fill_traces();
+
+    // Virtual instructions of the block at `address` up to the instruction that ends it. The tracer the
+    // block was traced on becomes the active one and the snapshot of the block.
+    //
+    std::vector<vm::Instruction> take_trace(uint64_t address);
+
+    // Write routine, worklist, explored blocks, snapshots and finished traces to the checkpoint file.
+    // Workers keep running, blocks still being traced are traced again on resume.
+    //
+    void save(uint64_t entrypoint);
+
+    // Load exploration state written by `save` and lift explored blocks again.
+    //
+    void restore(uint64_t entrypoint);
+
+    // Write blocks, their instructions and edges.
+    //
+    void write_routine(checkpoint::Writer& writer) const;
+
+    // Read routine written by `write_routine`. Returns blocks that were lifted.
+    //
+    std::vector<vm::BasicBlock*> read_routine(checkpoint::Reader& reader, uint64_t entrypoint);
+
+    // Path of the cache entry without extension. Entries are keyed by hashes of the binary and the
+    // intrinsics, and by the entrypoint.
+    //
+    std::string cache_entry(uint64_t entrypoint) const;
+
+    // Rebuild routine and its block functions from the cache. Returns false on a miss.
+    //
+    bool load_cache(uint64_t entrypoint);
+
+    // Store routine and its block functions in the cache.
+    //
+    void store_cache(uint64_t entrypoint) const;
+
     // LLVM Lifter instance.
     //
     std::shared_ptr<Lifter> lifter;
@@ -55,6 +110,31 @@ private:
     //
     std::map<uint64_t, std::shared_ptr<Tracer>> snapshots;
 
+    // Workers tracing blocks ahead of the exploration. Every block is traced on a fork of its snapshot
+    // while lifting and solving of earlier blocks stay on the exploring thread.
+    //
+    llvm::ThreadPool workers;
+
+    // Trace of a block and the tracer left in front of its branch.
+    //
+    struct Trace
+    {
+        std::shared_ptr<Tracer> tracer;
+        std::vector<vm::Instruction> insns;
+    };
+
+    // Traces of blocks that are not processed yet by block address. Bounded by `-trace-queue`.
+    //
+    std::map<uint64_t, std::shared_future<Trace>> traces;
+
+    // Worklist blocks that were not started because the trace queue was full, in worklist order.
+    //
+    std::vector<uint64_t> untraced;
+
+    // Names of external calls added to lifted exit blocks by block address.
+    //
+    std::map<uint64_t, std::string> external_calls;
+
     // Block that is currently processing.
     //
     vm::BasicBlock* block;
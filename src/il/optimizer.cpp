@@ -17,9 +17,21 @@
 #include <llvm/Analysis/CFLSteensAliasAnalysis.h>
 #include <llvm/Analysis/ScalarEvolutionAliasAnalysis.h>
 
+#include <llvm/Support/CommandLine.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Scalar/LoopRotation.h>
 
+#include <chrono>
+#include <unordered_set>
+
+llvm::cl::opt<unsigned> exhaust_fuel("exhaust-fuel",
+    llvm::cl::desc("Maximum number of pipeline runs spent on optimizing one function"),
+    llvm::cl::init(32));
+
+llvm::cl::opt<unsigned> exhaust_time("exhaust-time",
+    llvm::cl::desc("Wall time in milliseconds spent on optimizing one function, 0 for no limit"),
+    llvm::cl::init(0));
+
 namespace il
 {
 void replace_undefined_variable(llvm::Function* fn)
@@ -79,48 +91,98 @@ void strip_names(llvm::Function* fn)
     }
 }
 
-template<typename M, typename A, typename O>
-void exhaust_optimizations(M& manager,  A& analysis, O& object, uint64_t max_tries)
+// Hash of the function structure: instructions, their flags and operands. Values defined in the function
+// are identified by position, constants and globals are uniqued so their address identifies them.
+//
+uint64_t structural_hash(const llvm::Function& fn)
 {
-    auto inscount{ object.getInstructionCount() };
-    auto tries{ 0u };
-    while (true)
+    llvm::DenseMap<const llvm::Value*, unsigned> numbers;
+    for (const auto& arg : fn.args())
+        numbers.try_emplace(&arg, numbers.size());
+    for (const auto& bb : fn)
     {
-        manager.run(object, analysis);
-        if (inscount > object.getInstructionCount())
-        {
-            inscount = object.getInstructionCount();
-            tries    = 0;
-        }
-        else if (tries++ > max_tries)
+        numbers.try_emplace(&bb, numbers.size());
+        for (const auto& ins : bb)
+            numbers.try_emplace(&ins, numbers.size());
+    }
+    auto hash = llvm::hash_value(numbers.size());
+    for (const auto& bb : fn)
+    {
+        for (const auto& ins : bb)
         {
-            break;
+            hash = llvm::hash_combine(hash, ins.getOpcode(), ins.getType(), ins.getRawSubclassOptionalData());
+            if (auto cmp = llvm::dyn_cast<llvm::CmpInst>(&ins))
+                hash = llvm::hash_combine(hash, cmp->getPredicate());
+            for (const auto& op : ins.operands())
+            {
+                if (auto it = numbers.find(op.get()); it != numbers.end())
+                    hash = llvm::hash_combine(hash, it->second);
+                else
+                    hash = llvm::hash_combine(hash, op.get());
+            }
         }
     }
+    return hash;
 }
 
-void optimize_function(llvm::Function* fn, const opt_guide& guide)
+uint64_t structural_hash(const llvm::Module& module)
 {
-    llvm::AAManager aam;
-    llvm::PassBuilder pb;
-    llvm::LoopPassManager lpm;
-    llvm::LoopAnalysisManager lam;
-    llvm::CGSCCAnalysisManager cam;
-    llvm::ModuleAnalysisManager mam;
-    llvm::FunctionAnalysisManager fam;
+    auto hash = llvm::hash_combine(module.size(), module.global_size());
+    for (const auto& fn : module)
+    {
+        if (!fn.isDeclaration())
+            hash = llvm::hash_combine(hash, &fn, structural_hash(fn));
+    }
+    return hash;
+}
+
+// Pipeline runs and wall time left for optimizing one function.
+//
+struct Budget
+{
+    Budget()
+        : fuel    { exhaust_fuel }
+        , deadline{ std::chrono::steady_clock::now() + std::chrono::milliseconds(exhaust_time) }
+    {
+    }
 
-    auto ofpm = pb.buildFunctionSimplificationPipeline(guide.level, llvm::ThinOrFullLTOPhase::None);
-    auto ompm = pb.buildModuleOptimizationPipeline(guide.level, llvm::ThinOrFullLTOPhase::None);
+    // Take one pipeline run from the budget, false if it is used up.
+    //
+    bool consume() noexcept
+    {
+        if (fuel == 0 || (exhaust_time != 0 && std::chrono::steady_clock::now() >= deadline))
+            return false;
+        fuel--;
+        return true;
+    }
 
-    ofpm.addPass(llvm::createFunctionToLoopPassAdaptor(llvm::LoopRotatePass(), true, true, true));
-    // ofpm.addPass(MemoryCoalescingPass());
-    ofpm.addPass(llvm::VerifierPass());
+private:
+    unsigned fuel;
+    std::chrono::steady_clock::time_point deadline;
+};
 
-    while (inline_intrinsics(fn))
-        ;
+// Run `manager` until a fixpoint: a run that reports all analyses preserved, or one that produces IR seen
+// before. Over budget the result of the last completed run is kept, every run leaves valid IR. The budget
+// is shared by the phases of one function, each phase gets its first run even if earlier ones used it up.
+//
+template<typename M, typename A, typename O>
+void exhaust_optimizations(M& manager,  A& analysis, O& object, Budget& budget)
+{
+    std::unordered_set<uint64_t> seen{ structural_hash(object) };
+    for (bool first = true; budget.consume() || first; first = false)
+    {
+        if (manager.run(object, analysis).areAllPreserved())
+            break;
+        if (!seen.insert(structural_hash(object)).second)
+            break;
+    }
+}
 
+Optimizer::Optimizer(const opt_guide& guide) : guide{ guide }
+{
     if (guide.alias_analysis)
     {
+        llvm::AAManager aam;
         aam.registerFunctionAnalysis<SegmentsAA>();
         aam.registerFunctionAnalysis<llvm::BasicAA>();
         aam.registerFunctionAnalysis<llvm::ScopedNoAliasAA>();
@@ -137,48 +199,109 @@ void optimize_function(llvm::Function* fn, const opt_guide& guide)
     pb.registerFunctionAnalyses(fam);
     pb.crossRegisterProxies(lam, fam, cam, mam);
 
-    exhaust_optimizations(ofpm, fam, *fn, 2);
-
-    if (guide.remove_undef)
+    for (auto fpm : { &simplify, &finalize })
     {
-        replace_undefined_variable(fn);
+        *fpm = pb.buildFunctionSimplificationPipeline(guide.level, llvm::ThinOrFullLTOPhase::None);
+        fpm->addPass(llvm::createFunctionToLoopPassAdaptor(llvm::LoopRotatePass(), true, true, true));
+        // fpm->addPass(MemoryCoalescingPass());
+        fpm->addPass(llvm::VerifierPass());
     }
+    if (guide.apply_dse)
+    {
+        finalize.addPass(MemoryDependenciesPass());
+        finalize.addPass(FlagsSynthesisPass());
+    }
+    if (guide.run_on_module)
+    {
+        optimize_module = pb.buildModuleOptimizationPipeline(guide.level, llvm::ThinOrFullLTOPhase::None);
+    }
+}
 
-    exhaust_optimizations(ofpm, fam, *fn, 5);
+void Optimizer::run(llvm::Function* fn)
+{
+    optimize(fn);
+    invalidate();
+}
 
-    if (guide.apply_dse)
+void Optimizer::run(const std::vector<llvm::Function*>& fns)
+{
+    for (auto fn : fns)
+        optimize(fn);
+    invalidate();
+}
+
+void Optimizer::optimize(llvm::Function* fn)
+{
+    while (inline_intrinsics(fn))
+        ;
+
+    Budget budget;
+    exhaust_optimizations(simplify, fam, *fn, budget);
+
+    if (guide.remove_undef)
     {
-        ofpm.addPass(MemoryDependenciesPass());
-        ofpm.addPass(FlagsSynthesisPass());
+        replace_undefined_variable(fn);
     }
 
-    ofpm.run(*fn, fam);
+    exhaust_optimizations(simplify, fam, *fn, budget);
+
+    finalize.run(*fn, fam);
 
     if (guide.strip_names)
         strip_names(fn);
 
     if (guide.run_on_module)
     {
-        exhaust_optimizations(ompm, mam, *fn->getParent(), 5);
+        // Module passes walk every function, lazily loaded intrinsics have to be deserialized first.
+        //
+        if (auto error = fn->getParent()->materializeAll())
+        {
+            logger::error("optimize_function: Failed to materialize module: {}", llvm::toString(std::move(error)));
+        }
+        exhaust_optimizations(optimize_module, mam, *fn->getParent(), budget);
     }
+}
 
+void Optimizer::invalidate()
+{
+    // Function and loop analyses are owned through the module proxies and go with them. Functions
+    // optimized before may be erased, no result may outlive the run.
+    //
     cam.clear();
     lam.clear();
     fam.clear();
     mam.clear();
 }
 
-void optimize_block_function(llvm::Function* fn)
+void optimize_function(llvm::Function* fn, const opt_guide& guide)
 {
-    optimize_function(fn, {
+    Optimizer(guide).run(fn);
+}
+
+// Block functions are optimized for every lift and slice, keep their optimizer around.
+//
+static Optimizer& block_optimizer()
+{
+    static Optimizer optimizer({
         .strip_names = true,
         .level       = llvm::OptimizationLevel::O3
     });
+    return optimizer;
+}
+
+void optimize_block_function(llvm::Function* fn)
+{
+    block_optimizer().run(fn);
+}
+
+void optimize_block_functions(const std::vector<llvm::Function*>& fns)
+{
+    block_optimizer().run(fns);
 }
 
 void optimize_virtual_function(llvm::Function* fn)
 {
-    optimize_function(fn, {
+    static Optimizer optimizer({
         .remove_undef   = true,
         .run_on_module  = true,
         .strip_names    = true,
@@ -186,5 +309,6 @@ void optimize_virtual_function(llvm::Function* fn)
         .apply_dse      = true,
         .level          = llvm::OptimizationLevel::O3
     });
+    optimizer.run(fn);
 }
 }
@@ -6,8 +6,11 @@ class Function;
 class Module;
 };
 
+#include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/OptimizationLevel.h>
 
+#include <vector>
+
 namespace il
 {
 struct opt_guide
@@ -20,7 +23,49 @@ struct opt_guide
     llvm::OptimizationLevel level;
 };
 
+// Optimizer of functions sharing one guide. Pipelines and analysis registrations are built once and
+// reused, only analyses cached for the optimized functions are dropped after a run.
+//
+struct Optimizer
+{
+    explicit Optimizer(const opt_guide& guide);
+
+    void run(llvm::Function* fn);
+
+    // Optimize `fns` one after another with analyses dropped once at the end.
+    //
+    void run(const std::vector<llvm::Function*>& fns);
+
+private:
+    void optimize(llvm::Function* fn);
+
+    // Drop all cached analyses.
+    //
+    void invalidate();
+
+    opt_guide guide;
+
+    llvm::PassBuilder pb;
+    llvm::LoopAnalysisManager lam;
+    llvm::CGSCCAnalysisManager cam;
+    llvm::ModuleAnalysisManager mam;
+    llvm::FunctionAnalysisManager fam;
+
+    // Function pipeline repeated until no more progress is made.
+    //
+    llvm::FunctionPassManager simplify;
+
+    // Function pipeline run once at the end, with memory passes if the guide applies them.
+    //
+    llvm::FunctionPassManager finalize;
+
+    // Module pipeline if the guide runs on module.
+    //
+    llvm::ModulePassManager optimize_module;
+};
+
 void optimize_function(llvm::Function* fn, const opt_guide& guide);
 void optimize_block_function(llvm::Function* fn);
+void optimize_block_functions(const std::vector<llvm::Function*>& fns);
 void optimize_virtual_function(llvm::Function* fn);
 };
@@ -10,12 +10,32 @@
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Transforms/Scalar/SROA.h>
+#include <llvm/Transforms/Scalar/EarlyCSE.h>
+#include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/InstCombine/InstCombine.h>
+#include <set>
+#include <filesystem>
 #include <map>
 
 llvm::cl::opt<std::string> intrinsics("i",
-    llvm::cl::desc("Path to vmprotect intrinsics file"),
-    llvm::cl::value_desc("intrinsics"),
-    llvm::cl::Required);
+    llvm::cl::desc("Path to vmprotect intrinsics file (.ll or .bc), optional if intrinsics are embedded"),
+    llvm::cl::value_desc("intrinsics"));
+
+// Names of `Lifter::semantic_e` semantics without the size and offset suffixes.
+//
+static constexpr std::array<const char*, 16> semantic_names
+{
+    "ADD", "SHL", "SHR", "LOAD", "STORE", "NOR", "NAND", "SHRD", "SHLD",
+    "PUSH_IMM", "PUSH_REG", "PUSH_VREG", "PUSH_VSP", "POP_REG", "POP_VREG", "POP_VSP"
+};
 
 llvm::Value* ReturnArguments::return_address() const noexcept
 {
@@ -27,15 +47,58 @@ llvm::Value* ReturnArguments::program_counter() const noexcept
     return rip;
 }
 
+#ifdef TITAN_EMBED_INTRINSICS
+// Intrinsics bitcode compiled into the binary, see TITAN_EMBED_INTRINSICS in CMakeLists.txt.
+//
+extern const unsigned char embedded_intrinsics[];
+extern const size_t embedded_intrinsics_size;
+#endif
+
 Lifter::Lifter() : ir(context)
 {
-    llvm::SMDiagnostic err;
-    auto parsed = llvm::parseIRFile(intrinsics, err, context);
-    if (parsed == nullptr)
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    if (!intrinsics.empty())
     {
-        logger::error("Lifter::Lifter: Failed to parse intrinsics file");
+        auto file = llvm::MemoryBuffer::getFile(intrinsics);
+        if (!file)
+        {
+            logger::error("Lifter::Lifter: Failed to read intrinsics file");
+        }
+        buffer = std::move(file.get());
+    }
+    else
+    {
+#ifdef TITAN_EMBED_INTRINSICS
+        buffer = llvm::MemoryBuffer::getMemBuffer(
+            llvm::StringRef(reinterpret_cast<const char*>(embedded_intrinsics), embedded_intrinsics_size), "intrinsics", false);
+#else
+        logger::error("Lifter::Lifter: No intrinsics file given and none embedded");
+#endif
+    }
+    intrinsics_hash_ = llvm::xxHash64(buffer->getBuffer());
+    // Bitcode is loaded lazily, function bodies are only deserialized once they are used. Textual IR has
+    // to be parsed as a whole.
+    //
+    const auto start = reinterpret_cast<const unsigned char*>(buffer->getBufferStart());
+    const auto end   = reinterpret_cast<const unsigned char*>(buffer->getBufferEnd());
+    if (llvm::isBitcode(start, end))
+    {
+        auto loaded = llvm::getOwningLazyBitcodeModule(std::move(buffer), context);
+        if (!loaded)
+        {
+            logger::error("Lifter::Lifter: Failed to load intrinsics bitcode: {}", llvm::toString(loaded.takeError()));
+        }
+        module = std::move(loaded.get());
+    }
+    else
+    {
+        llvm::SMDiagnostic err;
+        module = llvm::parseIR(buffer->getMemBufferRef(), err, context);
+        if (module == nullptr)
+        {
+            logger::error("Lifter::Lifter: Failed to parse intrinsics file");
+        }
     }
-    module = std::move(parsed);
     // Extract helper functions.
     //
     helper_lifted_fn      = module->getFunction("VirtualFunction");
@@ -56,6 +119,14 @@ Lifter::Lifter() : ir(context)
         logger::error("Failed to find SlicePC function");
     if (helper_undef == nullptr)
         logger::error("Failed to find global undef variable");
+    // Helpers are cloned, so their bodies have to be present.
+    //
+    for (auto helper : { helper_lifted_fn, helper_empty_block_fn, helper_block_fn, helper_keep_fn, helper_slice_fn })
+    {
+        materialize(helper);
+    }
+    slice_generic_fn  = make_generic(helper_slice_fn);
+    lifted_generic_fn = make_generic(helper_lifted_fn);
     // Collect semantics functions.
     //
     for (const auto& glob : module->globals())
@@ -72,24 +143,60 @@ Lifter::Lifter() : ir(context)
             sems.emplace(name.str().substr(4), resolved_fn);
         }
     }
-}
-
-llvm::Function* Lifter::lift_basic_block(vm::BasicBlock* vblock)
-{
-    // Copy empty block function.
-    //
-    function = clone(helper_empty_block_fn);
-    // Remove bad attributes. Don't know if it does anything but still.
+    // Resolve semantics into the dense table so lifting does not format and hash names.
     //
-    for (auto& arg : function->args())
+    static_assert(semantic_names.size() == static_cast<size_t>(semantic_e::count));
+    for (size_t op = 0; op < semantic_names.size(); op++)
     {
-        arg.removeAttr(llvm::Attribute::ReadNone);
-        arg.removeAttr(llvm::Attribute::ReadOnly);
+        const auto vreg    = op == static_cast<size_t>(semantic_e::push_vreg) || op == static_cast<size_t>(semantic_e::pop_vreg);
+        const auto offsets = vreg ? static_cast<int>(semantic_offsets) : 1;
+        for (int size = 8; size <= 64; size *= 2)
+        {
+            for (int offset = 0; offset < offsets; offset++)
+            {
+                const auto name = vreg
+                    ? fmt::format("{}_{}_{}", semantic_names[op], size, offset)
+                    : fmt::format("{}_{}", semantic_names[op], size);
+                if (auto it = sems.find(name); it != sems.end())
+                {
+                    semantics[semantic_index(static_cast<semantic_e>(op), size, offset)] = { it->second, false };
+                }
+            }
+        }
     }
-    function->removeFnAttr(llvm::Attribute::ReadNone);
-    // Remove entry basic block and insert new one.
+    sem_jmp     = sem("JMP");
+    sem_ret     = sem("RET");
+    sem_jcc_inc = sem("JCC_INC");
+    sem_jcc_dec = sem("JCC_DEC");
+    // Resolve block function prototype and arguments. Attributes inferred for the empty body (readnone
+    // function and arguments) do not hold for lifted blocks.
     //
-    function->getEntryBlock().eraseFromParent();
+    block_fn_attributes = helper_empty_block_fn->getAttributes().removeFnAttribute(context, llvm::Attribute::ReadNone);
+    for (auto& arg : helper_empty_block_fn->args())
+    {
+        block_fn_attributes = block_fn_attributes.removeParamAttribute(context, arg.getArgNo(), llvm::Attribute::ReadNone);
+        block_fn_attributes = block_fn_attributes.removeParamAttribute(context, arg.getArgNo(), llvm::Attribute::ReadOnly);
+        arguments.emplace(arg.getName().str(), arg.getArgNo());
+    }
+    for (const auto name : { "vip", "vsp", "vmregs" })
+    {
+        if (arguments.find(name) == arguments.end())
+            logger::error("Lifter::Lifter: Failed to find {} argument of VirtualStubEmpty", name);
+    }
+    register_arguments.fill(-1);
+    for (size_t id = 0; id < vm::physical_register_names.size(); id++)
+    {
+        if (auto it = arguments.find(std::string(vm::physical_register_names[id])); it != arguments.end())
+            register_arguments[id] = static_cast<int>(it->second);
+    }
+    vip_index   = arguments.at("vip");
+    vsp_index   = arguments.at("vsp");
+    vregs_index = arguments.at("vmregs");
+}
+
+llvm::Function* Lifter::lift_basic_block(vm::BasicBlock* vblock)
+{
+    function = create_block_function();
 
     ir.SetInsertPoint(llvm::BasicBlock::Create(context, "lifted_bb", function));
     // Lift instruction stream.
@@ -101,25 +208,47 @@ llvm::Function* Lifter::lift_basic_block(vm::BasicBlock* vblock)
     // Return VIP.
     //
     ir.CreateRet(ir.CreateLoad(function->getReturnType(), vip()));
+    // Splice semantics into the block right away.
+    //
+    inline_semantics(function);
     return function;
 }
 
 llvm::Function* Lifter::build_function(const vm::Routine* rtn, uint64_t target_block)
 {
-    function = clone(helper_empty_block_fn);
-    function->getEntryBlock().eraseFromParent();
+    function   = create_block_function();
     auto block = llvm::BasicBlock::Create(context, "entry", function);
 
     std::vector<llvm::Value*> args;
     for (auto& arg : function->args())
         args.push_back(&arg);
-    // Create empty basic blocks for each basic block in the routine.
+    // Create empty basic blocks for each basic block in the routine. A partial function only needs blocks
+    // from which the target block can be reached, the others can not influence its program counter. This
+    // prunes the slice, it does not make building incremental: region and function are built anew.
     //
+    const auto partial = target_block != vm::invalid_vip;
+    const auto region  = partial ? rtn->ancestors(target_block) : std::set<uint64_t>{};
+
     std::map<uint64_t, llvm::BasicBlock*> blocks;
     for (const auto [vip, bb] : *rtn)
     {
-        blocks.emplace(vip, llvm::BasicBlock::Create(context, fmt::format("bb_0x{:x}", vip), function));
+        if (!partial || region.contains(vip))
+            blocks.emplace(vip, llvm::BasicBlock::Create(context, fmt::format("bb_0x{:x}", vip), function));
     }
+    // Edges leaving the region go to a block returning the same value as blocks that are not lifted yet.
+    //
+    llvm::BasicBlock* outside = nullptr;
+    const auto successor = [&](uint64_t vip)
+    {
+        if (auto it = blocks.find(vip); it != blocks.end())
+            return it->second;
+        if (outside == nullptr)
+        {
+            outside = llvm::BasicBlock::Create(context, "bb_outside", function);
+            llvm::ReturnInst::Create(context, ir.getInt64(0xdeadbeef), outside);
+        }
+        return outside;
+    };
     // Link together llvm basic blocks based on edges in routine and populate with calls to lifted functions.
     //
     for (auto [vip, bb] : blocks)
@@ -151,7 +280,7 @@ llvm::Function* Lifter::build_function(const vm::Routine* rtn, uint64_t target_b
                 case 1:
                 {
                     auto dst_vip = vblock->next.at(0)->vip();
-                    auto dst_blk = blocks.at(dst_vip);
+                    auto dst_blk = successor(dst_vip);
                     if (vblock->vip() == target_block && target_block != vm::invalid_vip)
                     {
                         // Create dummy basic block.
@@ -169,8 +298,8 @@ llvm::Function* Lifter::build_function(const vm::Routine* rtn, uint64_t target_b
                 }
                 case 2:
                 {
-                    auto dst_blk_1 = blocks.at(vblock->next.at(0)->vip());
-                    auto dst_blk_2 = blocks.at(vblock->next.at(1)->vip());
+                    auto dst_blk_1 = successor(vblock->next.at(0)->vip());
+                    auto dst_blk_2 = successor(vblock->next.at(1)->vip());
                     auto cmp       = ir.CreateICmpEQ(pc, ir.getInt64(vblock->next.at(0)->vip()));
                     ir.CreateCondBr(cmp, dst_blk_1, dst_blk_2);
                     break;
@@ -189,7 +318,98 @@ llvm::Function* Lifter::build_function(const vm::Routine* rtn, uint64_t target_b
     //
     if (target_block != vm::invalid_vip)
         return make_slice(function);
-    return make_final(function, rtn->entry->vip());
+    return make_final(function);
+}
+
+uint64_t Lifter::intrinsics_hash() const noexcept
+{
+    return intrinsics_hash_;
+}
+
+bool Lifter::save_functions(const std::map<std::string, llvm::Function*>& functions, const std::string& path)
+{
+    std::set<const llvm::GlobalValue*> definitions;
+    for (const auto& [name, fn] : functions)
+    {
+        definitions.insert(fn);
+    }
+    // Only bodies of the functions are cloned, this also keeps intrinsics that were never materialized as is.
+    //
+    llvm::ValueToValueMapTy map;
+    auto copy = llvm::CloneModule(*module, map, [&](const llvm::GlobalValue* gv)
+    {
+        return !llvm::isa<llvm::Function>(gv) || definitions.contains(gv);
+    });
+
+    std::vector<llvm::GlobalValue*> keep;
+    for (const auto& [name, fn] : functions)
+    {
+        auto cloned = llvm::cast<llvm::Function>(map[fn]);
+        cloned->setName(name);
+        keep.push_back(cloned);
+    }
+    // Drop everything except the functions, callees and globals become declarations.
+    //
+    llvm::legacy::PassManager pm;
+    pm.add(llvm::createGVExtractionPass(keep));
+    pm.add(llvm::createGlobalDCEPass());
+    pm.add(llvm::createStripDeadPrototypesPass());
+    pm.run(*copy);
+
+    // Written aside and renamed over `path`, a concurrent reader never sees a partial file.
+    //
+    const auto temporary = path + ".tmp";
+    std::error_code ec;
+    {
+        llvm::raw_fd_ostream stream(temporary, ec);
+        if (!ec)
+        {
+            llvm::WriteBitcodeToFile(*copy, stream);
+            stream.close();
+            ec = stream.error();
+            stream.clear_error();
+        }
+    }
+    if (!ec)
+        std::filesystem::rename(temporary, path, ec);
+    if (ec)
+    {
+        logger::warn("Lifter::save_functions: Failed to write {}: {}", path, ec.message());
+        std::filesystem::remove(temporary, ec);
+        return false;
+    }
+    return true;
+}
+
+std::map<std::string, llvm::Function*> Lifter::load_functions(const std::string& path)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer)
+        return {};
+
+    auto loaded = llvm::parseBitcodeFile(buffer.get()->getMemBufferRef(), context);
+    if (!loaded)
+    {
+        llvm::consumeError(loaded.takeError());
+        return {};
+    }
+    std::vector<std::string> names;
+    for (const auto& fn : *loaded.get())
+    {
+        if (!fn.isDeclaration())
+            names.push_back(fn.getName().str());
+    }
+    // Declarations are resolved against the intrinsics already in the module.
+    //
+    if (llvm::Linker::linkModules(*module, std::move(loaded.get())))
+        return {};
+
+    std::map<std::string, llvm::Function*> functions;
+    for (const auto& name : names)
+    {
+        functions.emplace(name, module->getFunction(name));
+    }
+    return functions;
 }
 
 ReturnArguments Lifter::get_return_args(llvm::Function* fn) const
@@ -210,124 +430,276 @@ ReturnArguments Lifter::get_return_args(llvm::Function* fn) const
     logger::error("Failed to find call to KeepReturnAddress funtion in {}", fn->getName().str());
 }
 
-llvm::Argument* Lifter::arg(llvm::Function* fn, const std::string& name)
+llvm::Argument* Lifter::arg(const std::string& name)
 {
-    for (auto& arg : fn->args())
-        if (arg.getName().equals(name))
-            return &arg;
+    if (auto it = arguments.find(name); it != arguments.end())
+        return function->getArg(it->second);
     return nullptr;
 }
 
-llvm::Argument* Lifter::arg(const std::string& name)
+llvm::Argument* Lifter::arg(const vm::PhysicalRegister& reg)
 {
-    return arg(function, name);
+    if (const auto index = register_arguments[reg.id()]; index >= 0)
+        return function->getArg(index);
+    logger::error("Lifter::arg: No argument for register {}", reg.name());
 }
 
-llvm::Function* Lifter::clone(llvm::Function* fn)
+llvm::Function* Lifter::create_block_function()
 {
-    llvm::ValueToValueMapTy map;
-    return llvm::CloneFunction(fn, map);
+    auto fn = llvm::Function::Create(helper_empty_block_fn->getFunctionType(), helper_empty_block_fn->getLinkage(), helper_empty_block_fn->getName(), module.get());
+    fn->setAttributes(block_fn_attributes);
+    fn->setCallingConv(helper_empty_block_fn->getCallingConv());
+    fn->setDSOLocal(helper_empty_block_fn->isDSOLocal());
+    for (auto& arg : fn->args())
+    {
+        arg.setName(helper_empty_block_fn->getArg(arg.getArgNo())->getName());
+    }
+    return fn;
 }
 
-llvm::Function* Lifter::sem(const std::string& name) const
+llvm::CallInst* Lifter::find_stub_call(llvm::Function* wrapper) const
 {
-    if (sems.find(name) == sems.end())
-        logger::error("Failed to find {} semantic", name);
-    return sems.at(name);
+    for (auto& ins : wrapper->getEntryBlock())
+    {
+        if (auto call = llvm::dyn_cast<llvm::CallInst>(&ins))
+        {
+            if (call->getCalledFunction() == helper_block_fn)
+                return call;
+        }
+    }
+    logger::error("Lifter::find_stub_call: Failed to find call to VirtualStub in {}", wrapper->getName().str());
 }
 
-llvm::Argument* Lifter::vip()
+llvm::Function* Lifter::sem(const std::string& name)
 {
-    return arg("vip");
+    if (sems.find(name) == sems.end())
+        logger::error("Failed to find {} semantic", name);
+    return prepare(sems.at(name));
 }
 
-llvm::Argument* Lifter::vsp()
+llvm::Function* Lifter::sem(semantic_e op, int size, int offset)
 {
-    return arg("vsp");
+    const auto index = semantic_index(op, size, offset);
+    if (index == semantics.size() || semantics[index].fn == nullptr)
+        logger::error("Failed to find {} semantic of size {} and offset {}", semantic_names[static_cast<size_t>(op)], size, offset);
+    auto& semantic = semantics[index];
+    if (!semantic.prepared)
+    {
+        prepare(semantic.fn);
+        semantic.prepared = true;
+    }
+    return semantic.fn;
 }
 
-llvm::Argument* Lifter::vregs()
+llvm::Function* Lifter::prepare(llvm::Function* fn)
 {
-    return arg("vmregs");
+    if (!prepared.insert(fn).second)
+        return fn;
+    materialize(fn);
+    // Callees are prepared first, their helpers are inlined already and a single round is enough.
+    //
+    for (auto call : inline_calls(fn))
+        prepare(call->getCalledFunction());
+    inline_semantics(fn);
+    // Light cleanup of the inlined helpers, full optimization runs on the lifted blocks.
+    //
+    llvm::PassBuilder pb;
+    llvm::LoopAnalysisManager lam;
+    llvm::CGSCCAnalysisManager cam;
+    llvm::ModuleAnalysisManager mam;
+    llvm::FunctionAnalysisManager fam;
+    pb.registerLoopAnalyses(lam);
+    pb.registerCGSCCAnalyses(cam);
+    pb.registerModuleAnalyses(mam);
+    pb.registerFunctionAnalyses(fam);
+    pb.crossRegisterProxies(lam, fam, cam, mam);
+
+    llvm::FunctionPassManager fpm;
+    fpm.addPass(llvm::SROAPass());
+    fpm.addPass(llvm::EarlyCSEPass(true));
+    fpm.addPass(llvm::InstCombinePass());
+    fpm.addPass(llvm::SimplifyCFGPass());
+    fpm.run(*fn, fam);
+    return fn;
+}
+
+void Lifter::inline_semantics(llvm::Function* fn)
+{
+    for (auto call : inline_calls(fn))
+    {
+        llvm::InlineFunctionInfo ifi;
+        llvm::InlineFunction(*call, ifi);
+    }
 }
 
-llvm::Function* Lifter::make_slice(llvm::Function* fn)
+std::vector<llvm::CallInst*> Lifter::inline_calls(llvm::Function* fn) const
 {
-    auto slice = clone(helper_slice_fn);
-    for (auto& ins : slice->getEntryBlock())
+    std::vector<llvm::CallInst*> calls;
+    for (auto& bb : *fn)
     {
-        if (auto call = llvm::dyn_cast<llvm::CallInst>(&ins))
+        for (auto& ins : bb)
         {
-            if (call->getCalledFunction() == helper_block_fn)
+            if (auto call = llvm::dyn_cast<llvm::CallInst>(&ins))
             {
-                call->setCalledFunction(fn);
-                break;
+                auto callee = call->getCalledFunction();
+                if (callee != nullptr && callee->hasFnAttribute(llvm::Attribute::AlwaysInline) && !callee->isDeclaration())
+                    calls.push_back(call);
             }
         }
     }
-    return slice;
+    return calls;
 }
 
-llvm::Function* Lifter::make_final(llvm::Function* fn, uint64_t addr)
+llvm::Function* Lifter::materialize(llvm::Function* fn)
 {
-    auto* final = clone(helper_lifted_fn);
-    for (auto& ins : final->getEntryBlock())
+    if (!fn->isMaterializable())
+        return fn;
+    if (auto error = fn->materialize())
     {
-        if (auto* call = llvm::dyn_cast<llvm::CallInst>(&ins))
+        logger::error("Lifter::materialize: Failed to materialize {}: {}", fn->getName().str(), llvm::toString(std::move(error)));
+    }
+    // Functions referenced by the body are inlined along with it.
+    //
+    for (auto& bb : *fn)
+    {
+        for (auto& ins : bb)
         {
-            if (call->getCalledFunction() == helper_block_fn)
+            for (auto& op : ins.operands())
             {
-                call->setCalledFunction(fn);
-                break;
+                if (auto callee = llvm::dyn_cast<llvm::Function>(op))
+                    materialize(callee);
             }
         }
     }
-    return final;
+    return fn;
+}
+
+size_t Lifter::semantic_index(semantic_e op, int size, int offset) noexcept
+{
+    size_t slot;
+    switch (size)
+    {
+        case 8:  slot = 0; break;
+        case 16: slot = 1; break;
+        case 32: slot = 2; break;
+        case 64: slot = 3; break;
+        default:
+            return static_cast<size_t>(semantic_e::count) * semantic_sizes * semantic_offsets;
+    }
+    if (offset < 0 || offset >= static_cast<int>(semantic_offsets))
+        return static_cast<size_t>(semantic_e::count) * semantic_sizes * semantic_offsets;
+    return (static_cast<size_t>(op) * semantic_sizes + slot) * semantic_offsets + offset;
+}
+
+llvm::Argument* Lifter::vip()
+{
+    return function->getArg(vip_index);
+}
+
+llvm::Argument* Lifter::vsp()
+{
+    return function->getArg(vsp_index);
+}
+
+llvm::Argument* Lifter::vregs()
+{
+    return function->getArg(vregs_index);
+}
+
+llvm::Function* Lifter::make_slice(llvm::Function* fn)
+{
+    return wrap(helper_slice_fn, slice_generic_fn, fn);
+}
+
+llvm::Function* Lifter::make_final(llvm::Function* fn)
+{
+    return wrap(helper_lifted_fn, lifted_generic_fn, fn);
+}
+
+llvm::Function* Lifter::make_generic(llvm::Function* wrapper)
+{
+    auto stub = find_stub_call(wrapper);
+
+    std::vector<llvm::Type*> params(wrapper->getFunctionType()->param_begin(), wrapper->getFunctionType()->param_end());
+    params.push_back(stub->getCalledOperand()->getType());
+    auto type    = llvm::FunctionType::get(wrapper->getReturnType(), params, false);
+    auto generic = llvm::Function::Create(type, wrapper->getLinkage(), wrapper->getName() + ".generic", module.get());
+
+    llvm::ValueToValueMapTy map;
+    for (auto& arg : wrapper->args())
+    {
+        auto copy = generic->getArg(arg.getArgNo());
+        copy->setName(arg.getName());
+        map[&arg] = copy;
+    }
+    llvm::SmallVector<llvm::ReturnInst*, 4> returns;
+    llvm::CloneFunctionInto(generic, wrapper, map, llvm::CloneFunctionChangeType::LocalChangesOnly, returns);
+    generic->addFnAttr(llvm::Attribute::AlwaysInline);
+    llvm::cast<llvm::CallInst>(map[stub])->setCalledOperand(generic->getArg(params.size() - 1));
+    return generic;
+}
+
+llvm::Function* Lifter::wrap(llvm::Function* wrapper, llvm::Function* generic, llvm::Function* fn)
+{
+    auto result = llvm::Function::Create(wrapper->getFunctionType(), wrapper->getLinkage(), wrapper->getName(), module.get());
+    result->copyAttributesFrom(wrapper);
+
+    std::vector<llvm::Value*> args;
+    for (auto& arg : result->args())
+    {
+        arg.setName(wrapper->getArg(arg.getArgNo())->getName());
+        args.push_back(&arg);
+    }
+    args.push_back(fn);
+
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(context, "entry", result));
+    builder.CreateRet(builder.CreateCall(generic, args));
+    return result;
 }
 
 void Lifter::operator()(const vm::Add& insn)
 {
-    ir.CreateCall(sem(fmt::format("ADD_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::add, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Shl& insn)
 {
-    ir.CreateCall(sem(fmt::format("SHL_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::shl, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Shr& insn)
 {
-    ir.CreateCall(sem(fmt::format("SHR_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::shr, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Ldr& insn)
 {
-    ir.CreateCall(sem(fmt::format("LOAD_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::load, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Str& insn)
 {
-    ir.CreateCall(sem(fmt::format("STORE_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::store, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Nor& insn)
 {
-    ir.CreateCall(sem(fmt::format("NOR_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::nor, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Nand& insn)
 {
-    ir.CreateCall(sem(fmt::format("NAND_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::nand, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Shrd& insn)
 {
-    ir.CreateCall(sem(fmt::format("SHRD_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::shrd, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Shld& insn)
 {
-    ir.CreateCall(sem(fmt::format("SHLD_{}", insn.size())), { vsp() });
+    ir.CreateCall(sem(semantic_e::shld, insn.size()), { vsp() });
 }
 
 void Lifter::operator()(const vm::Push& insn)
@@ -336,13 +708,13 @@ void Lifter::operator()(const vm::Push& insn)
 
     if (insn.op().is_immediate())
     {
-        ir.CreateCall(sem(fmt::format("PUSH_IMM_{}", size)), { vsp(), ir.getInt(llvm::APInt(size, insn.op().imm().value())) });
+        ir.CreateCall(sem(semantic_e::push_imm, size), { vsp(), ir.getInt(llvm::APInt(size, insn.op().imm().value())) });
     }
     else if (insn.op().is_physical())
     {
-        auto reg = arg(insn.op().phy().name());
+        auto reg = arg(insn.op().phy());
         auto ldr = ir.CreateLoad(ir.getInt64Ty(), reg);
-        ir.CreateCall(sem(fmt::format("PUSH_REG_{}", size)), { vsp(), ldr });
+        ir.CreateCall(sem(semantic_e::push_reg, size), { vsp(), ldr });
     }
     else if (insn.op().is_virtual())
     {
@@ -350,11 +722,11 @@ void Lifter::operator()(const vm::Push& insn)
         auto off = insn.op().vrt().offset();
         auto gep = ir.CreateInBoundsGEP(vregs()->getType(), vregs(), { ir.getInt(llvm::APInt(size, num)) });
         auto ldr = ir.CreateLoad(ir.getInt64Ty(), gep);
-        ir.CreateCall(sem(fmt::format("PUSH_VREG_{}_{}", size, off)), { vsp(), ldr });
+        ir.CreateCall(sem(semantic_e::push_vreg, size, off), { vsp(), ldr });
     }
     else if (insn.op().is_vsp())
     {
-        ir.CreateCall(sem(fmt::format("PUSH_VSP_{}", size)), { vsp() });
+        ir.CreateCall(sem(semantic_e::push_vsp, size), { vsp() });
     }
     else
     {
@@ -368,18 +740,18 @@ void Lifter::operator()(const vm::Pop& insn)
 
     if (insn.op().is_physical())
     {
-        ir.CreateCall(sem(fmt::format("POP_REG_{}", size)), { vsp(), arg(insn.op().phy().name()) });
+        ir.CreateCall(sem(semantic_e::pop_reg, size), { vsp(), arg(insn.op().phy()) });
     }
     else if (insn.op().is_virtual())
     {
         auto num = insn.op().vrt().number();
         auto off = insn.op().vrt().offset();
         auto gep = ir.CreateInBoundsGEP(vregs()->getType(), vregs(), { ir.getInt(llvm::APInt(size, num)) });
-        ir.CreateCall(sem(fmt::format("POP_VREG_{}_{}", size, off)), { vsp(), gep });
+        ir.CreateCall(sem(semantic_e::pop_vreg, size, off), { vsp(), gep });
     }
     else if (insn.op().is_vsp())
     {
-        ir.CreateCall(sem(fmt::format("POP_VSP_{}", size)), { vsp() });
+        ir.CreateCall(sem(semantic_e::pop_vsp, size), { vsp() });
     }
     else
     {
@@ -389,23 +761,23 @@ void Lifter::operator()(const vm::Pop& insn)
 
 void Lifter::operator()(const vm::Jmp& insn)
 {
-    ir.CreateCall(sem("JMP"), { vsp(), vip() });
+    ir.CreateCall(sem_jmp, { vsp(), vip() });
 }
 
 void Lifter::operator()(const vm::Ret& insn)
 {
-    ir.CreateCall(sem("RET"), { vsp(), vip() });
+    ir.CreateCall(sem_ret, { vsp(), vip() });
 }
 
 void Lifter::operator()(const vm::Jcc& insn)
 {
     if (insn.direction() == vm::jcc_e::up)
     {
-        ir.CreateCall(sem("JCC_INC"), { vsp(), vip() });
+        ir.CreateCall(sem_jcc_inc, { vsp(), vip() });
     }
     else
     {
-        ir.CreateCall(sem("JCC_DEC"), { vsp(), vip() });
+        ir.CreateCall(sem_jcc_dec, { vsp(), vip() });
     }
 }
 
@@ -7,6 +7,11 @@
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 
+#include <map>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+
 struct ReturnArguments
 {
     explicit ReturnArguments(llvm::Value* rip, llvm::Value* ret) : rip{ rip }, ret{ ret } {}
@@ -30,7 +35,9 @@ struct Lifter
     //
     llvm::Function* lift_basic_block(vm::BasicBlock* block);
 
-    // Build paritual or full control flow graph of a routine.
+    // Build paritual or full control flow graph of a routine. A partial function is pruned to the blocks
+    // the target block can be reached from. It is rebuilt from scratch on every call, so building costs
+    // O(blocks) per query.
     //
     llvm::Function* build_function(const vm::Routine* routine, uint64_t target_block = vm::invalid_vip);
 
@@ -40,6 +47,19 @@ struct Lifter
 
     void create_external_call(llvm::Function* function, const std::string& name);
 
+    // Hash of the intrinsics file the semantics were loaded from.
+    //
+    uint64_t intrinsics_hash() const noexcept;
+
+    // Write `functions` into a standalone bitcode file, renamed to their keys. Functions they call are
+    // kept as declarations. Returns false if the file could not be written.
+    //
+    bool save_functions(const std::map<std::string, llvm::Function*>& functions, const std::string& path);
+
+    // Link functions written by `save_functions` into the module. Returns them by name, empty on failure.
+    //
+    std::map<std::string, llvm::Function*> load_functions(const std::string& path);
+
     void operator()(const vm::Add&);
     void operator()(const vm::Shl&);
     void operator()(const vm::Shr&);
@@ -58,6 +78,38 @@ struct Lifter
     void operator()(const vm::Enter&);
 
 private:
+    // Semantics that come in several sizes (and virtual register offsets).
+    //
+    enum class semantic_e : size_t
+    {
+        add,
+        shl,
+        shr,
+        load,
+        store,
+        nor,
+        nand,
+        shrd,
+        shld,
+        push_imm,
+        push_reg,
+        push_vreg,
+        push_vsp,
+        pop_reg,
+        pop_vreg,
+        pop_vsp,
+        count
+    };
+
+    // Supported operand sizes are 8, 16, 32 and 64 bits, virtual register offsets are 0 to 7 bytes.
+    //
+    static constexpr size_t semantic_sizes   = 4;
+    static constexpr size_t semantic_offsets = 8;
+
+    // Index into `semantics` or `semantics.size()` if size or offset is not supported.
+    //
+    static size_t semantic_index(semantic_e op, int size, int offset) noexcept;
+
     llvm::Value* create_memory_read_64(llvm::Value* address);
     llvm::Value* create_memory_write_64(llvm::Value* address, llvm::Value* ptr);
 
@@ -77,20 +129,55 @@ private:
 
     // Get llvm function for vmp instruction.
     //
-    llvm::Function* sem(const std::string& name) const;
+    llvm::Function* sem(const std::string& name);
+
+    // Get llvm function for sized vmp instruction from the semantics table.
+    //
+    llvm::Function* sem(semantic_e op, int size, int offset = 0);
+
+    // Deserialize body of lazily loaded `fn` and of functions it references.
+    //
+    llvm::Function* materialize(llvm::Function* fn);
 
-    // Get function argument by name.
+    // Materialize semantic `fn`, inline its helpers and simplify it. Done once per semantic so that
+    // lifted blocks start from small IR.
     //
-    llvm::Argument* arg(llvm::Function* fn, const std::string& name);
+    llvm::Function* prepare(llvm::Function* fn);
 
-    // Get function argument by name.
+    // Inline calls to always inline functions in `fn`. Callees are expected to be prepared, as the ones
+    // returned by `sem` are.
+    //
+    void inline_semantics(llvm::Function* fn);
+
+    // Calls in `fn` to always inline functions with a body.
+    //
+    std::vector<llvm::CallInst*> inline_calls(llvm::Function* fn) const;
+
+    // Get current function argument by name.
     //
     llvm::Argument* arg(const std::string& name);
 
-    // Shallow copy function into a new one.
-    // The global variables which the function accesses will not be copied.
+    // Get current function argument of physical register.
+    //
+    llvm::Argument* arg(const vm::PhysicalRegister& reg);
+
+    // Create bodiless function with the prototype and attributes of `helper_empty_block_fn`.
+    //
+    llvm::Function* create_block_function();
+
+    // Find call to `helper_block_fn` in `wrapper`.
     //
-    llvm::Function* clone(llvm::Function* fn);
+    llvm::CallInst* find_stub_call(llvm::Function* wrapper) const;
+
+    // Copy `wrapper` once into a function that takes the block function to call instead of
+    // `helper_block_fn` as an extra last argument.
+    //
+    llvm::Function* make_generic(llvm::Function* wrapper);
+
+    // Create function with the prototype of `wrapper` whose body calls `generic` with its arguments and
+    // `fn`. The generic body is inlined by the optimizer.
+    //
+    llvm::Function* wrap(llvm::Function* wrapper, llvm::Function* generic, llvm::Function* fn);
 
     // Wrap `fn` with helper_slice_fn function.
     //
@@ -98,7 +185,7 @@ private:
 
     // Wrap `fn` with helper_lifted_fn function.
     //
-    llvm::Function* make_final(llvm::Function* fn, uint64_t vip);
+    llvm::Function* make_final(llvm::Function* fn);
 
     // Current basic block function that is being lifted.
     //
@@ -112,6 +199,42 @@ private:
     //
     std::unordered_map<std::string, llvm::Function*> sems;
 
+    // Sized semantics indexed by (op, size, offset), resolved once from `sems`. Missing entries are nullptr.
+    // Entries are prepared on first use, the flag spares lookups in `prepared` when lifting.
+    //
+    struct Semantic
+    {
+        llvm::Function* fn;
+        bool prepared;
+    };
+    std::array<Semantic, static_cast<size_t>(semantic_e::count) * semantic_sizes * semantic_offsets> semantics{};
+
+    // Semantics and their helpers that were prepared already.
+    //
+    std::unordered_set<llvm::Function*> prepared;
+
+    // Control flow semantics.
+    //
+    llvm::Function* sem_jmp;
+    llvm::Function* sem_ret;
+    llvm::Function* sem_jcc_inc;
+    llvm::Function* sem_jcc_dec;
+
+    // Attributes of block functions.
+    //
+    llvm::AttributeList block_fn_attributes;
+
+    // Block function argument indices by name. Every block function is created by `create_block_function`
+    // with the type of `helper_empty_block_fn`, so they share the layout.
+    //
+    std::unordered_map<std::string, unsigned> arguments;
+    // Argument indices by `vm::PhysicalRegister::id`, -1 for registers without an argument.
+    //
+    std::array<int, vm::physical_register_names.size() + 1> register_arguments;
+    unsigned vip_index;
+    unsigned vsp_index;
+    unsigned vregs_index;
+
     // Helpers loaded from intrinsics file.
     //
     llvm::Function* helper_lifted_fn;
@@ -121,6 +244,15 @@ private:
     llvm::Function* helper_keep_fn;
     llvm::Value*    helper_undef;
 
+    // `helper_slice_fn` and `helper_lifted_fn` calling the block function passed as last argument.
+    //
+    llvm::Function* slice_generic_fn;
+    llvm::Function* lifted_generic_fn;
+
+    // Hash of the intrinsics file.
+    //
+    uint64_t intrinsics_hash_;
+
     llvm::LLVMContext context;
     std::unique_ptr<llvm::Module> module;
 };
@@ -4,17 +4,37 @@
 #include "logger.hpp"
 #include "binary.hpp"
 #include "utils.hpp"
+#include "scanner.hpp"
 
 #include <llvm/Support/Signals.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/PrettyStackTrace.h>
+#include <llvm/Support/raw_ostream.h>
 
 #include <fstream>
+#include <unordered_set>
 
-llvm::cl::opt<uint64_t> entrypoint("e",
-    llvm::cl::desc("Virtual address of vmenter"),
+llvm::cl::list<uint64_t> entrypoints("e",
+    llvm::cl::desc("Virtual addresses of vmenter, comma separated"),
     llvm::cl::value_desc("entrypoint"),
-    llvm::cl::Required);
+    llvm::cl::CommaSeparated,
+    llvm::cl::ZeroOrMore);
+
+llvm::cl::opt<std::string> entrypoints_file("entrypoints",
+    llvm::cl::desc("Path to a file with virtual addresses of vmenter separated by whitespace"),
+    llvm::cl::value_desc("path"),
+    llvm::cl::init(""),
+    llvm::cl::Optional);
+
+llvm::cl::opt<bool> scan("scan",
+    llvm::cl::desc("Find entrypoints by scanning executable sections for vmenter stubs"),
+    llvm::cl::init(false),
+    llvm::cl::Optional);
+
+llvm::cl::opt<bool> split_output("split-output",
+    llvm::cl::desc("Write every routine into function.<entrypoint>.<output>"),
+    llvm::cl::init(false),
+    llvm::cl::Optional);
 
 llvm::cl::opt<std::string> output("o",
     llvm::cl::desc("Path to the output .ll file"),
@@ -46,6 +66,41 @@ static const std::vector<const char*> optimization_args =
     "-unroll-threshold=1000000"
 };
 
+// Entrypoints from the command line followed by the ones from the entrypoints file and the scanner, without
+// duplicates.
+//
+static std::vector<uint64_t> collect_entrypoints(const std::shared_ptr<Tracer>& tracer)
+{
+    std::vector<uint64_t> result(entrypoints.begin(), entrypoints.end());
+    if (!entrypoints_file.empty())
+    {
+        std::ifstream file(entrypoints_file);
+        if (!file)
+        {
+            logger::error("Failed to open entrypoints file {}", entrypoints_file.getValue());
+        }
+        for (std::string token; file >> token;)
+        {
+            result.push_back(std::stoull(token, nullptr, 0));
+        }
+    }
+    if (scan)
+    {
+        auto found = scan_entrypoints(tracer);
+        logger::info("scan found {} entrypoints", found.size());
+        result.insert(result.end(), found.begin(), found.end());
+    }
+    // Every routine is lifted once, the first occurrence keeps its position.
+    //
+    std::unordered_set<uint64_t> seen;
+    std::erase_if(result, [&](uint64_t entrypoint){ return !seen.insert(entrypoint).second; });
+    if (result.empty())
+    {
+        logger::error("No entrypoints, use -e, -entrypoints or -scan.");
+    }
+    return result;
+}
+
 int main(int argc, char** argv)
 {
     // Inject optimization options to argv.
@@ -61,16 +116,39 @@ int main(int argc, char** argv)
     //
     llvm::cl::ParseCommandLineOptions(args.size(), args.data());
 
+    // Routines are processed one after another in the same module, so intrinsics are parsed once. Tracers of
+    // every routine share the image, the decoded instructions and the classified handlers.
+    //
     auto lifter = std::make_shared<Lifter>();
     auto tracer = std::make_shared<Tracer>(triton::arch::architecture_e::ARCH_X86_64);
-    Explorer explorer(lifter, tracer);
 
-    auto rtn = explorer.explore(entrypoint);
-    auto fn  = lifter->build_function(rtn.get());
+    const auto targets = collect_entrypoints(tracer);
 
-    il::optimize_virtual_function(fn);
+    std::error_code ec;
+    std::unique_ptr<llvm::raw_fd_ostream> merged;
+    if (!split_output)
+    {
+        merged = std::make_unique<llvm::raw_fd_ostream>(fmt::format("function.{}", output), ec);
+        if (ec)
+        {
+            logger::error("Failed to open function.{}: {}", output.getValue(), ec.message());
+        }
+    }
+    for (const auto entrypoint : targets)
+    {
+        Explorer explorer(lifter, tracer->spawn());
 
-    save_ir(fn, fmt::format("function.{}", output));
+        auto rtn = explorer.explore(entrypoint);
+        auto fn  = lifter->build_function(rtn.get());
 
+        il::optimize_virtual_function(fn);
+        fn->setName(fmt::format("function.0x{:x}", entrypoint));
+        // Module optimizations of later routines may touch this one, write it right away.
+        //
+        if (split_output)
+            save_ir(fn, fmt::format("function.0x{:x}.{}", entrypoint, output));
+        else
+            fn->print(*merged, nullptr);
+    }
     return 0;
 }
@@ -0,0 +1,72 @@
+#include "memory.hpp"
+
+#include <algorithm>
+
+Memory::Memory(std::shared_ptr<Binary> image) noexcept
+    : image{ std::move(image) }
+{
+}
+
+std::vector<uint8_t> Memory::read(uint64_t address, size_t size) const noexcept
+{
+    std::vector<uint8_t> raw(size);
+    for (size_t done = 0; done < size;)
+    {
+        const auto curr  = address + done;
+        const auto off   = curr - page_base(curr);
+        const auto chunk = std::min<size_t>(size - done, page_size - off);
+
+        if (auto data = page(curr))
+            std::copy_n(data->begin() + off, chunk, raw.begin() + done);
+        else
+            image->read(curr, { raw.data() + done, chunk });
+        done += chunk;
+    }
+    return raw;
+}
+
+void Memory::write(uint64_t address, const std::vector<uint8_t>& bytes) noexcept
+{
+    for (size_t done = 0; done < bytes.size();)
+    {
+        const auto curr  = address + done;
+        const auto off   = curr - page_base(curr);
+        const auto chunk = std::min<size_t>(bytes.size() - done, page_size - off);
+
+        auto& data = own(page_index(curr));
+        std::copy_n(bytes.begin() + done, chunk, data.begin() + off);
+        done += chunk;
+    }
+}
+
+void Memory::share(uint64_t index, std::shared_ptr<Page> page) noexcept
+{
+    pages[index] = std::move(page);
+}
+
+const Memory::Page* Memory::page(uint64_t address) const noexcept
+{
+    if (auto it = pages.find(page_index(address)); it != pages.end())
+        return it->second.get();
+    return nullptr;
+}
+
+Memory::Page& Memory::own(uint64_t index) noexcept
+{
+    auto& page = pages[index];
+    if (page == nullptr)
+    {
+        // First write into this page, populate it with the image contents.
+        //
+        page = std::make_shared<Page>();
+        page->fill(0);
+        image->read(index * page_size, *page);
+    }
+    else if (page.use_count() > 1)
+    {
+        // Page is shared with another snapshot, copy it before writing.
+        //
+        page = std::make_shared<Page>(*page);
+    }
+    return *page;
+}
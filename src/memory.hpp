@@ -0,0 +1,60 @@
+#pragma once
+
+#include "binary.hpp"
+
+#include <map>
+#include <array>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+// Page-granular copy-on-write store of the emulated memory.
+// Copies share every page with the original until one of them writes into it, so copying
+// costs O(dirty pages) pointer copies and no bytes at all.
+//
+struct Memory
+{
+    static constexpr uint64_t page_size = 0x1000;
+
+    using Page = std::array<uint8_t, page_size>;
+
+    explicit Memory(std::shared_ptr<Binary> image) noexcept;
+
+    // Read `size` bytes starting at `address`. Bytes of pages that were never written
+    // are taken from the image.
+    //
+    std::vector<uint8_t> read(uint64_t address, size_t size) const noexcept;
+
+    // Write `bytes` at `address`. Shared pages are copied before the write.
+    //
+    void write(uint64_t address, const std::vector<uint8_t>& bytes) noexcept;
+
+    // Use `page` as written page with `index`, shared copy-on-write with its other owners.
+    //
+    void share(uint64_t index, std::shared_ptr<Page> page) noexcept;
+
+    // Page holding `address` or nullptr if it was never written.
+    //
+    const Page* page(uint64_t address) const noexcept;
+
+    static uint64_t page_index(uint64_t address) noexcept { return address / page_size; }
+    static uint64_t page_base (uint64_t address) noexcept { return address & ~(page_size - 1); }
+
+    // Iterate written pages as (page index, page) pairs.
+    //
+    auto begin() const noexcept { return pages.begin(); }
+    auto end()   const noexcept { return pages.end();   }
+
+private:
+    // Get writable page, populating it from the image or copying it if it is shared.
+    //
+    Page& own(uint64_t index) noexcept;
+
+    // Image the memory falls back to.
+    //
+    std::shared_ptr<Binary> image;
+
+    // Written pages by page index.
+    //
+    std::map<uint64_t, std::shared_ptr<Page>> pages;
+};
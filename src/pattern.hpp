@@ -0,0 +1,177 @@
+#pragma once
+
+#include <triton/ast.hpp>
+
+#include <cstdint>
+#include <utility>
+
+// Declarative Triton AST patterns. Patterns are types and are expanded by the compiler into plain node
+// type comparisons. A `table` of rules classifies an AST in one descent through its extract layers: on
+// every layer the node type decides which rules can match, and only those walk the node.
+//
+// Variable patterns ask a context callable `ctx(node, role)` whether the variable node has the role.
+//
+namespace pattern
+{
+// Matches any node.
+//
+struct any
+{
+    static constexpr bool accepts(triton::ast::ast_e) noexcept { return true; }
+
+    static bool match(const triton::ast::SharedAbstractNode&, const auto&) noexcept { return true; }
+};
+
+// Matches symbolic variable with `Role`.
+//
+template<uint32_t Role>
+struct variable
+{
+    static constexpr bool accepts(triton::ast::ast_e type) noexcept { return type == triton::ast::VARIABLE_NODE; }
+
+    static bool match(const triton::ast::SharedAbstractNode& node, const auto& ctx)
+    {
+        return node->getType() == triton::ast::VARIABLE_NODE && ctx(node, Role);
+    }
+};
+
+// Matches node of `Type` whose leading children match `Children` in order. Remaining children are not checked.
+//
+template<triton::ast::ast_e Type, typename... Children>
+struct node
+{
+    static constexpr bool accepts(triton::ast::ast_e type) noexcept { return type == Type; }
+
+    static bool match(const triton::ast::SharedAbstractNode& node, const auto& ctx)
+    {
+        if (node->getType() != Type)
+            return false;
+        const auto& children = node->getChildren();
+        if (children.size() < sizeof...(Children))
+            return false;
+        return match_children(children, ctx, std::index_sequence_for<Children...>{});
+    }
+
+private:
+    template<size_t... Index>
+    static bool match_children(const std::vector<triton::ast::SharedAbstractNode>& children, const auto& ctx, std::index_sequence<Index...>)
+    {
+        return (Children::match(children[Index], ctx) && ...);
+    }
+};
+
+// Matches any of `Patterns`, tried in order.
+//
+template<typename... Patterns>
+struct either
+{
+    static constexpr bool accepts(triton::ast::ast_e type) noexcept { return (Patterns::accepts(type) || ...); }
+
+    static bool match(const triton::ast::SharedAbstractNode& node, const auto& ctx)
+    {
+        return (Patterns::match(node, ctx) || ...);
+    }
+};
+
+// Stores of sub-registers wrap the stored value into `((_ extract) (op _ value))` layers. Layer 0 is the
+// root, layer n + 1 is the second operand of the extract operand of layer n. Rules match their pattern
+// at the layers below, a plain pattern matches the root only.
+//
+// Matches `Pattern` at any layer.
+//
+template<typename Pattern>
+struct extracted
+{
+};
+
+// Matches `Pattern` at layer `Depth` only.
+//
+template<size_t Depth, typename Pattern>
+struct layer
+{
+};
+
+namespace detail
+{
+    // Where a rule pattern applies: `accepts` tells from the node type and layer alone whether the
+    // pattern can match, `match` checks the node itself.
+    //
+    template<typename Pattern>
+    struct layered
+    {
+        static constexpr bool accepts(triton::ast::ast_e type, size_t depth) noexcept { return depth == 0 && Pattern::accepts(type); }
+
+        static bool match(const triton::ast::SharedAbstractNode& node, const auto& ctx, size_t) { return Pattern::match(node, ctx); }
+    };
+
+    template<typename Pattern>
+    struct layered<extracted<Pattern>>
+    {
+        static constexpr bool accepts(triton::ast::ast_e type, size_t) noexcept { return Pattern::accepts(type); }
+
+        static bool match(const triton::ast::SharedAbstractNode& node, const auto& ctx, size_t) { return Pattern::match(node, ctx); }
+    };
+
+    template<size_t Depth, typename Pattern>
+    struct layered<layer<Depth, Pattern>>
+    {
+        static constexpr bool accepts(triton::ast::ast_e type, size_t depth) noexcept { return depth == Depth && Pattern::accepts(type); }
+
+        static bool match(const triton::ast::SharedAbstractNode& node, const auto& ctx, size_t) { return Pattern::match(node, ctx); }
+    };
+
+    template<typename... Patterns>
+    struct layered<either<Patterns...>>
+    {
+        static constexpr bool accepts(triton::ast::ast_e type, size_t depth) noexcept { return (layered<Patterns>::accepts(type, depth) || ...); }
+
+        static bool match(const triton::ast::SharedAbstractNode& node, const auto& ctx, size_t depth)
+        {
+            const auto type = node->getType();
+            return ((layered<Patterns>::accepts(type, depth) && layered<Patterns>::match(node, ctx, depth)) || ...);
+        }
+    };
+};
+
+// Associates `Pattern` with a `Result` type.
+//
+template<typename Result, typename Pattern>
+struct rule
+{
+    using result  = Result;
+    using pattern = Pattern;
+};
+
+// Ordered set of rules. The first rule that matches at the outermost layer wins.
+//
+template<typename... Rules>
+struct table
+{
+    // Classify `node` and call `fn.template operator()<Result>()` for the matched rule.
+    // Returns false if no rule matched.
+    //
+    static bool classify(const triton::ast::SharedAbstractNode& node, const auto& ctx, auto&& fn)
+    {
+        // Extract layers are walked once for all rules. On every layer the node type selects the rules,
+        // only those walk the node.
+        //
+        auto current = node;
+        for (size_t depth = 0;; depth++)
+        {
+            const auto type = current->getType();
+            if (((detail::layered<typename Rules::pattern>::accepts(type, depth) &&
+                  detail::layered<typename Rules::pattern>::match(current, ctx, depth) &&
+                  (fn.template operator()<typename Rules::result>(), true)) || ...))
+            {
+                return true;
+            }
+            if (type != triton::ast::EXTRACT_NODE)
+                return false;
+            const auto& operand = current->getChildren()[2];
+            if (operand->getChildren().size() < 2)
+                return false;
+            current = operand->getChildren()[1];
+        }
+    }
+};
+};
@@ -0,0 +1,93 @@
+#include "scanner.hpp"
+#include "logger.hpp"
+
+#include <llvm/Support/CommandLine.h>
+
+#include <map>
+#include <bit>
+#include <cstring>
+#include <algorithm>
+#include <emmintrin.h>
+
+llvm::cl::opt<unsigned> scan_budget("scan-budget",
+    llvm::cl::desc("Maximum number of instructions executed to confirm a vmenter candidate"),
+    llvm::cl::value_desc("instructions"),
+    llvm::cl::init(2000),
+    llvm::cl::Optional);
+
+static constexpr auto stack_base = 0x10000;
+
+// Size of `push imm32; call rel32`.
+//
+static constexpr size_t stub_size = 10;
+
+// Offsets of `push imm32; call rel32` in `code`. 16 positions are tested at once by comparing the opcode of
+// the push and the opcode of the call 5 bytes later.
+//
+static std::vector<size_t> find_stubs(std::span<const uint8_t> code)
+{
+    std::vector<size_t> offsets;
+    if (code.size() < stub_size)
+        return offsets;
+
+    const auto push = _mm_set1_epi8(static_cast<char>(0x68));
+    const auto call = _mm_set1_epi8(static_cast<char>(0xe8));
+    // Last offset a stub can start at.
+    //
+    const auto last = code.size() - stub_size;
+
+    size_t offset = 0;
+    for (; offset + 15 <= last; offset += 16)
+    {
+        const auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(code.data() + offset));
+        const auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(code.data() + offset + 5));
+
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(lo, push), _mm_cmpeq_epi8(hi, call))));
+        while (mask != 0)
+        {
+            offsets.push_back(offset + std::countr_zero(mask));
+            mask &= mask - 1;
+        }
+    }
+    for (; offset <= last; offset++)
+    {
+        if (code[offset] == 0x68 && code[offset + 5] == 0xe8)
+            offsets.push_back(offset);
+    }
+    return offsets;
+}
+
+std::vector<uint64_t> scan_entrypoints(const std::shared_ptr<Tracer>& tracer)
+{
+    const auto& image = tracer->binary();
+    // Candidates grouped by call target. Stubs of one vm share vmenter, so every target is confirmed once.
+    //
+    std::map<uint64_t, std::vector<uint64_t>> candidates;
+    for (const auto& [address, code] : image.code())
+    {
+        for (const auto offset : find_stubs(code))
+        {
+            int32_t rel{};
+            std::memcpy(&rel, code.data() + offset + 6, sizeof(rel));
+            const auto target = address + offset + stub_size + static_cast<int64_t>(rel);
+
+            if (auto section = image.get_section(target); section && section->isText())
+                candidates[target].push_back(address + offset);
+        }
+    }
+
+    std::vector<uint64_t> entrypoints;
+    for (const auto& [target, stubs] : candidates)
+    {
+        auto probe = tracer->spawn();
+        probe->write(probe->rip_register(), stubs.front());
+        probe->write(probe->rsp_register(), stack_base);
+        if (!probe->probe_vmenter(scan_budget))
+            continue;
+
+        logger::info("vmenter 0x{:x}: {} entrypoints", target, stubs.size());
+        entrypoints.insert(entrypoints.end(), stubs.begin(), stubs.end());
+    }
+    std::sort(entrypoints.begin(), entrypoints.end());
+    return entrypoints;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "tracer.hpp"
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+// Find VMProtect entry stubs `push imm32; call vmenter` in executable sections of the traced image.
+// Candidates are confirmed by running the call target as vmenter on a tracer spawned from `tracer`.
+// Returns addresses of the pushes sorted by address.
+//
+std::vector<uint64_t> scan_entrypoints(const std::shared_ptr<Tracer>& tracer);
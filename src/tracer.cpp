@@ -2,7 +2,19 @@
 #include "tracer.hpp"
 #include "logger.hpp"
 #include "utils.hpp"
+#include "pattern.hpp"
 
+#include <bit>
+
+#include <triton/exceptions.hpp>
+#include <llvm/Support/CommandLine.h>
+
+llvm::cl::opt<uint64_t> symbolic_variable_limit("symbolic-variable-limit",
+    llvm::cl::desc("Number of symbolic variables after which a tracer recreates its symbolic engine"),
+    llvm::cl::init(1 << 16));
+
+// Aliases of symbolic variables, used for printing and by AST matchers.
+//
 namespace variable
 {
     static const std::string rsp          = "rsp";
@@ -12,108 +24,224 @@ namespace variable
     static const std::string vsp_fetch    = "[vsp]";
     static const std::string vregs        = "vregs";
     static const std::string memory_fetch = "[memory]";
+
+    static const std::string& alias(uint32_t value)
+    {
+        switch (value)
+        {
+        case role::rsp:          return rsp;
+        case role::vip:          return vip;
+        case role::vip_fetch:    return vip_fetch;
+        case role::vsp:          return vsp;
+        case role::vsp_fetch:    return vsp_fetch;
+        case role::vregs:        return vregs;
+        case role::memory_fetch: return memory_fetch;
+        default:
+            logger::error("variable::alias: Unknown role {}.", value);
+        }
+    }
 };
 
-// Match [vsp] + [vsp].
-//
-static bool match_add(const triton::ast::SharedAbstractNode& ast)
+bool Variables::has(uint32_t var_role) const noexcept
+{
+    return (mask & var_role) != 0;
+}
+
+bool Variables::only(uint32_t roles) const noexcept
 {
-    if (ast->getType() == triton::ast::EXTRACT_NODE)
+    return mask == roles && list.size() == static_cast<size_t>(std::popcount(roles));
+}
+
+auto Variables::get(uint32_t var_role) const noexcept -> std::optional<triton::engines::symbolic::SharedSymbolicVariable>
+{
+    for (const auto& [bits, var] : list)
     {
-        return match_add(ast->getChildren()[2]->getChildren()[1]);
+        if (bits & var_role)
+            return var;
     }
-    return ast->getType() == triton::ast::BVADD_NODE
-        && is_variable(ast->getChildren()[1], variable::vsp_fetch);
+    return {};
 }
 
-// Match `~[vsp] | ~[vsp]`.
+// Patterns of arithmetic handlers. Stores of sub-registers wrap the operation into
+// `((_ extract) (concat _ op))` layers, see `pattern::extracted` and `pattern::layer`.
 //
-static bool match_nand(const triton::ast::SharedAbstractNode& ast)
+namespace patterns
 {
+    using namespace pattern;
+
+    // Match [vsp] + [vsp].
+    //
+    using add = extracted<node<triton::ast::BVADD_NODE, any, variable<role::vsp_fetch>>>;
+
+    // Match `~[vsp] | ~[vsp]`.
     // For nand_8 ast is following:
     // ((_ extract 15 0) (concat ((_ extract 63 8) (concat (_ bv0 48) [vsp])) (bvor (bvnot ((_ extract 7 0) [vsp])) (bvnot [vsp]))))
     //
-    if (ast->getType() == triton::ast::EXTRACT_NODE)
-    {
-        return match_nand(ast->getChildren()[2]->getChildren()[1]);
-    }
-    return ast->getType() == triton::ast::BVOR_NODE
-        && ast->getChildren()[1]->getType() == triton::ast::BVNOT_NODE
-        && is_variable(ast->getChildren()[1]->getChildren()[0], variable::vsp_fetch);
-}
+    using nand = extracted<node<triton::ast::BVOR_NODE, any, node<triton::ast::BVNOT_NODE, variable<role::vsp_fetch>>>>;
 
-// Match `~[vsp] & ~[vsp]`.
-//
-static bool match_nor(const triton::ast::SharedAbstractNode& ast)
-{
+    // Match `~[vsp] & ~[vsp]`.
     // For nor_8 ast is following:
     // ((_ extract 15 0) (concat ((_ extract 63 8) (concat (_ bv0 48) [vsp])) (bvand (bvnot ((_ extract 7 0) [vsp])) (bvnot [vsp]))))
     //
-    if (ast->getType() == triton::ast::EXTRACT_NODE)
-    {
-        return match_nor(ast->getChildren()[2]->getChildren()[1]);
-    }
-    return ast->getType() == triton::ast::BVAND_NODE
-        && ast->getChildren()[1]->getType() == triton::ast::BVNOT_NODE
-        && is_variable(ast->getChildren()[1]->getChildren()[0], variable::vsp_fetch);
+    using nor = extracted<node<triton::ast::BVAND_NODE, any, node<triton::ast::BVNOT_NODE, variable<role::vsp_fetch>>>>;
+
+    // Match `[vsp] >> ([vsp] & 0x3f)`.
+    //
+    using shr = either<
+        layer<1, node<triton::ast::BVLSHR_NODE>>,
+        node<triton::ast::BVLSHR_NODE, variable<role::vsp_fetch>, node<triton::ast::BVAND_NODE>>
+    >;
+
+    // Match `[vsp] << ([vsp] & 0x3f)`.
+    // For shl_8: ((_ extract 15 0) (concat ((_ extract 63 8) (concat (_ bv281474976710649 48) [vsp])) (bvshl ((_ extract 7 0) [vsp]) (bvand [vsp] (_ bv31 8)))))
+    //
+    using shl = either<
+        layer<1, node<triton::ast::BVSHL_NODE>>,
+        node<triton::ast::BVSHL_NODE, variable<role::vsp_fetch>, node<triton::ast::BVAND_NODE>>
+    >;
+
+    // Match `ror((([vsp]) << 32 | [vsp]), 0x0, 64)`.
+    //
+    using shrd = node<triton::ast::EXTRACT_NODE, any, any, node<triton::ast::BVROR_NODE>>;
+
+    // Match `((_ extract 31 0) ((_ rotate_left 0) (concat [vsp] [vsp])))`.
+    //
+    using shld = node<triton::ast::EXTRACT_NODE, any, any, node<triton::ast::BVROL_NODE>>;
+
+    // Rules are tried in order on every layer, the first match wins.
+    //
+    using arithmetic = table<
+        rule<vm::Add,  add>,
+        rule<vm::Nand, nand>,
+        rule<vm::Nor,  nor>,
+        rule<vm::Shr,  shr>,
+        rule<vm::Shl,  shl>,
+        rule<vm::Shrd, shrd>,
+        rule<vm::Shld, shld>
+    >;
+};
+
+Tracer::Tracer(triton::arch::architecture_e arch) noexcept
+    : Emulator(arch)
+    , position{}
+    , roles_base{}
+    , handlers{ std::make_shared<HandlerCache>() }
+    , pool    { std::make_shared<TracerPool>()   }
+{
+    physical_registers_count = (arch == triton::arch::ARCH_X86_64 ? 16 : 8);
 }
 
-// Match `[vsp] >> ([vsp] & 0x3f)`.
-//
-static bool match_shr(const triton::ast::SharedAbstractNode& ast)
+Tracer::Tracer(triton::arch::architecture_e arch, std::shared_ptr<Binary> image) noexcept
+    : Emulator(arch, std::move(image))
+    , position{}
+    , roles_base{}
+{
+    physical_registers_count = (arch == triton::arch::ARCH_X86_64 ? 16 : 8);
+}
+
+Tracer::Tracer(Tracer const& other) noexcept
+    : Emulator(other)
+    , physical_registers_count{ other.physical_registers_count }
+    , vip_register_name       { other.vip_register_name        }
+    , vsp_register_name       { other.vsp_register_name        }
+    , position                {                                }
+    , roles_base              {                                }
+    , handlers                { other.handlers                 }
+    , pool                    { other.pool                     }
+{
+}
+
+void Tracer::adopt(Tracer const& origin) noexcept
 {
-    // for shr
-    if (ast->getType() == triton::ast::EXTRACT_NODE && ast->getChildren()[2]->getType() == triton::ast::CONCAT_NODE)
+    // Recreating the engines costs about as much as a new context. As for handlers traced in place, it
+    // is only done once the variables left behind by previous users exceed the limit.
+    //
+    if (roles_base + roles.size() > symbolic_variable_limit)
     {
-        return ast->getChildren()[2]->getChildren()[1]->getType() == triton::ast::BVLSHR_NODE;
+        reset_engines();
+        roles_base = 0;
     }
-    return ast->getType() == triton::ast::BVLSHR_NODE
-        && ast->getChildren()[1]->getType() == triton::ast::BVAND_NODE
-        && is_variable(ast->getChildren()[0], variable::vsp_fetch);
+    reset(origin.image);
+    decoded  = origin.decoded;
+    handlers = origin.handlers;
+    pool     = origin.pool;
+
+    vip_register_name.reset();
+    vsp_register_name.reset();
+    probe.reset();
+    position = 0;
+    cache.clear();
+    positions.clear();
+    roles.clear();
 }
 
-// Match `[vsp] << ([vsp] & 0x3f)`.
-//
-static bool match_shl(const triton::ast::SharedAbstractNode& ast)
+std::shared_ptr<Tracer> TracerPool::acquire(Tracer const& origin)
 {
-    // for shl_8: ((_ extract 15 0) (concat ((_ extract 63 8) (concat (_ bv281474976710649 48) [vsp])) (bvshl ((_ extract 7 0) [vsp]) (bvand [vsp] (_ bv31 8)))))
-    //
-    if (ast->getType() == triton::ast::EXTRACT_NODE && ast->getChildren()[2]->getType() == triton::ast::CONCAT_NODE)
+    std::unique_ptr<Tracer> tracer;
     {
-        return ast->getChildren()[2]->getChildren()[1]->getType() == triton::ast::BVSHL_NODE;
+        std::lock_guard guard(lock);
+        if (!idle.empty())
+        {
+            tracer = std::move(idle.back());
+            idle.pop_back();
+        }
+    }
+    if (tracer == nullptr)
+    {
+        tracer.reset(new Tracer(origin.getArchitecture(), origin.image));
     }
-    return ast->getType() == triton::ast::BVSHL_NODE
-        && ast->getChildren()[1]->getType() == triton::ast::BVAND_NODE
-        && is_variable(ast->getChildren()[0], variable::vsp_fetch);
+    tracer->adopt(origin);
+    // Idle tracers do not reference the pool, otherwise the pool would never be freed.
+    //
+    return std::shared_ptr<Tracer>(tracer.release(), [](Tracer* tracer)
+    {
+        auto pool = std::move(tracer->pool);
+        pool->release(tracer);
+    });
 }
 
-// Match `ror((([vsp]) << 32 | [vsp]), 0x0, 64)`
-static bool match_shrd(const triton::ast::SharedAbstractNode& ast)
+void TracerPool::release(Tracer* tracer) noexcept
 {
-    return ast->getType() == triton::ast::EXTRACT_NODE
-        && ast->getChildren()[2]->getType() == triton::ast::BVROR_NODE;
+    std::lock_guard guard(lock);
+    idle.emplace_back(tracer);
 }
 
-// Match `((_ extract 31 0) ((_ rotate_left 0) (concat [vsp] [vsp])))`.
-//
-static bool match_shld(const triton::ast::SharedAbstractNode& ast)
+std::shared_ptr<const HandlerRecipe> HandlerCache::find(const HandlerKey& key)
 {
-    return ast->getType() == triton::ast::EXTRACT_NODE
-        && ast->getChildren()[2]->getType() == triton::ast::BVROL_NODE;
+    std::lock_guard guard(lock);
+    if (auto it = recipes.find(key); it != recipes.end())
+        return it->second;
+    return nullptr;
 }
 
-Tracer::Tracer(triton::arch::architecture_e arch) noexcept
-    : Emulator(arch)
+void HandlerCache::insert(const HandlerKey& key, HandlerRecipe recipe)
 {
-    physical_registers_count = (arch == triton::arch::ARCH_X86_64 ? 16 : 8);
+    std::lock_guard guard(lock);
+    if (!unstable.contains(key))
+        recipes.emplace(key, std::make_shared<const HandlerRecipe>(std::move(recipe)));
 }
 
-Tracer::Tracer(Tracer const& other) noexcept
-    : Emulator(other)
-    , physical_registers_count{ other.physical_registers_count }
-    , vip_register_name       { other.vip_register_name        }
-    , vsp_register_name       { other.vsp_register_name        }
+void HandlerCache::evict(const HandlerKey& key)
+{
+    std::lock_guard guard(lock);
+    recipes.erase(key);
+    unstable.insert(key);
+}
+
+void Tracer::save(checkpoint::Writer& writer) const
+{
+    Emulator::save(writer);
+    writer.write(vip_register_name.value_or(""));
+    writer.write(vsp_register_name.value_or(""));
+}
+
+void Tracer::load(checkpoint::Reader& reader)
 {
+    Emulator::load(reader);
+    if (auto name = reader.read_string(); !name.empty())
+        vip_register_name = std::move(name);
+    if (auto name = reader.read_string(); !name.empty())
+        vsp_register_name = std::move(name);
 }
 
 uint64_t Tracer::vip() const
@@ -138,73 +266,215 @@ const triton::arch::Register& Tracer::vsp_register() const
     return getRegister(vsp_register_name.value());
 }
 
+triton::engines::symbolic::SharedSymbolicVariable Tracer::symbolize(const triton::arch::Register& reg, uint32_t var_role)
+{
+    auto var = symbolizeRegister(reg, variable::alias(var_role));
+    // Variable ids grow monotonically, roles are indexed relative to the first variable of the handler.
+    //
+    if (roles.empty())
+        roles_base = var->getId();
+    const auto index = var->getId() - roles_base;
+    if (roles.size() <= index)
+        roles.resize(index + 1, role::none);
+    roles[index] = var_role;
+    return var;
+}
+
+uint32_t Tracer::role_of(const triton::engines::symbolic::SharedSymbolicVariable& var) const noexcept
+{
+    const auto id = var->getId();
+    if (id < roles_base || id - roles_base >= roles.size())
+        return role::none;
+    return roles[id - roles_base];
+}
+
+bool Tracer::is_symbolic_address(const triton::arch::MemoryAccess& mem) const
+{
+    const auto& base  = mem.getConstBaseRegister();
+    const auto& index = mem.getConstIndexRegister();
+    return (base.getId()  != triton::arch::ID_REG_INVALID && isRegisterSymbolized(base))
+        || (index.getId() != triton::arch::ID_REG_INVALID && isRegisterSymbolized(index));
+}
+
+void Tracer::reset_symbolic_state()
+{
+    // Drop every reference to expressions of the previous handler, they are freed together with their ASTs.
+    // Only concrete values are carried over to the next handler.
+    //
+    concretizeAllRegister();
+    concretizeAllMemory();
+    // Triton keeps every symbolic variable for the lifetime of the engine. Variable ids are sequential, so
+    // the ids used by the previous handler tell how many there are.
+    //
+    if (roles_base + roles.size() > symbolic_variable_limit)
+    {
+        reset_engines();
+        roles_base = 0;
+    }
+    cache.clear();
+    positions.clear();
+    roles.clear();
+}
+
+Variables Tracer::variables(const triton::ast::SharedAbstractNode& ast) const
+{
+    Variables vars;
+    for_each_variable(ast, [&](const triton::engines::symbolic::SharedSymbolicVariable& var)
+    {
+        const uint32_t var_role = role_of(var);
+        vars.mask |= var_role;
+        vars.list.emplace_back(var_role, var);
+    });
+    return vars;
+}
+
 std::shared_ptr<Tracer> Tracer::fork() const noexcept
 {
-    return std::make_shared<Tracer>(*this);
+    auto tracer = pool->acquire(*this);
+    tracer->assign(*this);
+    tracer->vip_register_name = vip_register_name;
+    tracer->vsp_register_name = vsp_register_name;
+    return tracer;
+}
+
+std::shared_ptr<Tracer> Tracer::spawn() const noexcept
+{
+    return pool->acquire(*this);
 }
 
 vm::Instruction Tracer::step(step_t type)
 {
-    auto tracer = fork();
+    if (auto vinsn = replay_handler(type))
+    {
+        return vinsn.value();
+    }
+    // Handler is traced in place. Writes are journaled so the tracer can be moved back in front of
+    // a branch without keeping a copy of the whole context.
+    //
+    Checkpoint scope(*this);
 
-    if (auto vinsn_mb = tracer->process_instruction())
+    if (auto vinsn_mb = process_instruction())
     {
         auto vinsn = vinsn_mb.value();
-        if (vm::op_enter(vinsn))
-        {
-            vip_register_name = tracer->vip_register_name;
-            vsp_register_name = tracer->vsp_register_name;
-        }
         if (vm::op_branch(vinsn) && type == step_t::stop_before_branch)
+        {
+            scope.rollback();
             return vinsn;
+        }
+        scope.commit();
 
         if (vm::op_jcc(vinsn))
         {
             vip_register_name = std::get<vm::Jcc>(vinsn).vip_register();
             vsp_register_name = std::get<vm::Jcc>(vinsn).vsp_register();
         }
-        // Cicle tracer to the current rip value.
-        //
-        while (true)
-        {
-            auto insn = disassemble();
-            if (insn.getAddress() == tracer->rip())
-                break;
-            execute(insn);
-        }
         return vinsn;
     }
     logger::error("Failed to process instruction");
 }
 
+std::optional<vm::Instruction> Tracer::replay_handler(step_t type)
+{
+    if (!vip_register_name.has_value() || !vsp_register_name.has_value())
+        return {};
+
+    const HandlerKey key{ rip(), vip_register_name.value(), vsp_register_name.value() };
+    auto recipe_ptr = handlers->find(key);
+    if (recipe_ptr == nullptr)
+        return {};
+
+    const auto& recipe = *recipe_ptr;
+    if (vm::op_branch(recipe.shape) && type == step_t::stop_before_branch)
+        return recipe.shape;
+    // Execute handler concretely and pick up operand value on the way. If the handler takes another
+    // path than when it was classified, undo the replay and let it be traced symbolically.
+    //
+    Checkpoint scope(*this);
+    uint64_t value{};
+    for (size_t index = 0; index < recipe.stream.size(); index++)
+    {
+        auto insn = disassemble();
+        if (insn.getAddress() != recipe.stream[index])
+        {
+            logger::warn("Tracer::replay_handler: Handler diverged at 0x{:x}, expected 0x{:x}.", insn.getAddress(), recipe.stream[index]);
+            scope.rollback();
+            handlers->evict(key);
+            return {};
+        }
+        if (recipe.probe && recipe.probe->index == index && !recipe.probe->after)
+            value = read(recipe.probe->reg);
+        execute_concrete(insn);
+        if (recipe.probe && recipe.probe->index == index && recipe.probe->after)
+            value = read(recipe.probe->reg);
+    }
+    scope.commit();
+    // Restore operand.
+    //
+    auto vinsn = recipe.shape;
+    if (auto push = std::get_if<vm::Push>(&vinsn))
+    {
+        if (push->op().is_immediate())
+            vinsn = vm::Push(vm::Immediate(value), push->size());
+        else if (push->op().is_virtual())
+            vinsn = vm::Push(vm::VirtualRegister(value / ptrsize(), value % ptrsize()), push->size());
+    }
+    else if (auto pop = std::get_if<vm::Pop>(&vinsn))
+    {
+        if (pop->op().is_virtual())
+            vinsn = vm::Pop(vm::VirtualRegister(value / ptrsize(), value % ptrsize()), pop->size());
+    }
+    if (auto jcc = std::get_if<vm::Jcc>(&vinsn))
+    {
+        vip_register_name = jcc->vip_register();
+        vsp_register_name = jcc->vsp_register();
+    }
+    return vinsn;
+}
+
 std::optional<vm::Instruction> Tracer::process_instruction()
 {
     if (!vip_register_name.has_value() || !vsp_register_name.has_value())
     {
         return process_vmenter();
     }
-    // List of matched virtual instructions for this handler.
-    //
-    std::vector<vm::Instruction> vinsn;
+    const HandlerKey key{ rip(), vip_register_name.value(), vsp_register_name.value() };
     // List of executed instructions.
     //
     std::vector<triton::arch::Instruction> stream;
+
+    auto vinsn = process_handler(stream);
+    if (vinsn.has_value())
+    {
+        remember_handler(key, stream, vinsn.value());
+    }
+    return vinsn;
+}
+
+std::optional<vm::Instruction> Tracer::process_handler(std::vector<triton::arch::Instruction>& stream)
+{
+    // List of matched virtual instructions for this handler.
+    //
+    std::vector<vm::Instruction> vinsn;
     // Symbolize bytecode and virtual stack.
     //
-    symbolizeRegister(vip_register(), "vip");
-    symbolizeRegister(vsp_register(), "vsp");
-    symbolizeRegister(rsp_register(), "rsp");
+    reset_symbolic_state();
+    symbolize(vip_register(), role::vip);
+    symbolize(vsp_register(), role::vsp);
+    symbolize(rsp_register(), role::rsp);
 
-    cache.clear();
+    probe.reset();
     std::set<std::string> poped_registers;
     std::vector<vm::Pop>  poped_context;
 
     while (true)
     {
         auto insn = disassemble();
+        position  = stream.size();
         // Handle memory write.
         //
-        if (op_mov_memory_register(insn))
+        // Stores through concrete addresses can not be virtual instructions, skip them before building any AST.
+        //
+        if (op_mov_memory_register(insn) && is_symbolic_address(insn.operands[0].getConstMemory()))
         {
             getSymbolicEngine()->initLeaAst(insn.operands[0].getMemory());
             if (auto vins = process_store(insn))
@@ -250,14 +520,18 @@ std::optional<vm::Instruction> Tracer::process_instruction()
             stream.push_back(std::move(insn));
             break;
         }
+        const auto control_flow = insn.isControlFlow();
         stream.push_back(std::move(insn));
-
-        auto variables = collect_variables(getRegisterAst(rip_register()));
-
-        if (has_variable(variables, variable::vip_fetch) ||
-            has_variable(variables, variable::memory_fetch, variable::vsp_fetch))
+        // Handler can only end with an indirect transfer, rip is concrete after any other instruction.
+        //
+        if (control_flow)
         {
-            break;
+            auto rip_variables = variables(getRegisterAst(rip_register()));
+
+            if (rip_variables.has(role::vip_fetch) || rip_variables.only(role::memory_fetch | role::vsp_fetch))
+            {
+                break;
+            }
         }
         if (!rip())
         {
@@ -267,34 +541,36 @@ std::optional<vm::Instruction> Tracer::process_instruction()
 
     if (vinsn.empty())
     {
-        const auto variables = collect_variables(getRegisterAst(rip_register()));
-        if (has_variable(variables, variable::memory_fetch, variable::vsp_fetch))
+        const auto rip_variables = variables(getRegisterAst(rip_register()));
+        if (rip_variables.only(role::memory_fetch | role::vsp_fetch))
         {
             // Jcc handler.
             //
-            auto comment   = get_variable(variables, variable::memory_fetch).value()->getComment();
+            auto comment   = rip_variables.get(role::memory_fetch).value()->getComment();
             auto vip_reg   = getRegister(comment);
             auto vip_ast   = triton::ast::unroll(getRegisterAst(vip_reg));
             auto direction = vip_ast->getType() == triton::ast::BVADD_NODE ? vm::jcc_e::up : vm::jcc_e::down;
             // Pick next handler and deduce vsp register. We know that the first instruction after jcc is pop so
             // first memory access should be access to vsp.
-            auto tracer = fork();
-            for (int i = 0; i < 10; i++)
+            Checkpoint scope(*this);
+            std::optional<std::string> vsp_reg;
+            for (int i = 0; i < 10 && !vsp_reg.has_value(); i++)
             {
-                auto insn = tracer->single_step();
+                auto insn = single_step();
                 if (op_mov_register_memory(insn))
                 {
-                    auto& vsp_reg = insn.operands[1].getConstMemory().getConstBaseRegister();
-                    return vm::Jcc(
-                        direction,
-                        vip_reg.getName(),
-                        vsp_reg.getName()
-                    );
+                    vsp_reg = insn.operands[1].getConstMemory().getConstBaseRegister().getName();
                 }
             }
-            fassert("Failed to process jcc instruction.");
+            scope.rollback();
+            fassert(vsp_reg.has_value() && "Failed to process jcc instruction.");
+            return vm::Jcc(
+                direction,
+                vip_reg.getName(),
+                vsp_reg.value()
+            );
         }
-        else if (has_variable(variables, variable::vip_fetch) && ranges::any_of(stream, op_lea_rip))
+        else if (rip_variables.has(role::vip_fetch) && ranges::any_of(stream, op_lea_rip))
         {
             // Jmp handler.
             //
@@ -316,7 +592,53 @@ std::optional<vm::Instruction> Tracer::process_instruction()
     return vinsn.at(0);
 }
 
-std::optional<vm::Instruction> Tracer::process_vmenter()
+void Tracer::remember_handler(const HandlerKey& key, const std::vector<triton::arch::Instruction>& stream, const vm::Instruction& vinsn)
+{
+    // Replay relies on the handler taking the same path every time, so only straight-line handlers
+    // whose control flow is decided by the last instruction are cached.
+    //
+    for (size_t i = 0; i + 1 < stream.size(); i++)
+    {
+        const auto& insn = stream[i];
+        if (insn.isControlFlow() && !(insn.getType() == triton::arch::x86::ID_INS_JMP && insn.operands[0].getType() == triton::arch::OP_IMM))
+            return;
+    }
+    // Operand values of these instructions are only known with a probe.
+    //
+    const auto needs_probe = std::visit([](const auto& insn)
+    {
+        using T = std::decay_t<decltype(insn)>;
+        if constexpr (std::is_same_v<T, vm::Push>)
+            return insn.op().is_immediate() || insn.op().is_virtual();
+        else if constexpr (std::is_same_v<T, vm::Pop>)
+            return insn.op().is_virtual();
+        return false;
+    }, vinsn);
+
+    if (needs_probe && !probe.has_value())
+        return;
+
+    HandlerRecipe recipe{ vinsn, {}, needs_probe ? probe : std::nullopt };
+    for (const auto& insn : stream)
+        recipe.stream.push_back(insn.getAddress());
+    handlers->insert(key, std::move(recipe));
+}
+
+bool Tracer::probe_vmenter(size_t budget)
+{
+    try
+    {
+        return process_vmenter(budget, false).has_value();
+    }
+    catch (const std::exception&)
+    {
+        // Bytes that do not decode or that Triton fails to model.
+        //
+        return false;
+    }
+}
+
+std::optional<vm::Instruction> Tracer::process_vmenter(size_t budget, bool verbose)
 {
     // Save rsp for future lookup.
     //
@@ -332,7 +654,16 @@ std::optional<vm::Instruction> Tracer::process_vmenter()
     //
     while (true)
     {
-        auto insn = single_step();
+        if (stream.size() >= budget)
+            return {};
+
+        auto insn = disassemble();
+        if (buildSemantics(insn) != triton::arch::NO_FAULT)
+        {
+            if (verbose)
+                logger::warn("Failed to execute vmenter instruction at 0x{:x}.", insn.getAddress());
+            return {};
+        }
 
         if (op_mov_register_register(insn))
         {
@@ -361,6 +692,9 @@ std::optional<vm::Instruction> Tracer::process_vmenter()
 
     if (!vip_register_name.has_value() || !vsp_register_name.has_value())
     {
+        if (!verbose)
+            return {};
+
         logger::warn("No virtual registers were found:");
         logger::warn("\tvip: {}", vip_register_name.has_value() ? "found" : "not found");
         logger::warn("\tvsp: {}", vsp_register_name.has_value() ? "found" : "not found");
@@ -383,6 +717,10 @@ std::optional<vm::Instruction> Tracer::process_vmenter()
         {
             auto ast  = triton::ast::unroll(getMemoryAst(memory));
             auto size = ast->getBitvectorSize();
+            // Probed code is arbitrary, a context that is not made of variables just rejects it.
+            //
+            if (!verbose && ast->getType() != triton::ast::VARIABLE_NODE)
+                return {};
             fassert(ast->getType() == triton::ast::VARIABLE_NODE);
             context.push_back(vm::Push(vm::PhysicalRegister(to_variable(ast)->getAlias()), size));
         }
@@ -411,12 +749,12 @@ std::optional<vm::Instruction> Tracer::process_store(const triton::arch::Instruc
     const auto& reg    = insn.operands[1].getConstRegister();
     auto mem_ast       = triton::ast::unroll(mem.getLeaAst());
     auto reg_ast       = triton::ast::unroll(getRegisterAst(reg));
-    auto mem_variables = collect_variables(mem_ast);
-    auto reg_variables = collect_variables(reg_ast);
+    auto mem_variables = variables(mem_ast);
+    auto reg_variables = variables(reg_ast);
 
     auto size = reg_ast->getBitvectorSize();
 
-    if (reg_ast->getType() == triton::ast::EXTRACT_NODE && size == 16 && !has_variable(reg_variables, variable::vsp))
+    if (reg_ast->getType() == triton::ast::EXTRACT_NODE && size == 16 && !reg_variables.has(role::vsp))
     {
         size = 8;
     }
@@ -424,27 +762,29 @@ std::optional<vm::Instruction> Tracer::process_store(const triton::arch::Instruc
     // movzx ax, byte ptr [vsp]
     // mov [vmregs + offset], ax
     //
-    if (has_variable(mem_variables, variable::rsp, variable::vip_fetch) &&
-        has_variable(reg_variables, variable::vsp_fetch))
+    if (mem_variables.only(role::rsp | role::vip_fetch) &&
+        reg_variables.has(role::vsp_fetch))
     {
         auto write_off = read(mem.getConstIndexRegister());
         auto number    = write_off / ptrsize();
         auto offset    = write_off % ptrsize();
-        auto original  = lookup_instruction(get_variable(reg_variables, variable::vsp_fetch).value());
+        auto original  = lookup_instruction(reg_variables.get(role::vsp_fetch).value());
+        probe = HandlerProbe{ position, false, mem.getConstIndexRegister() };
         return vm::Pop(vm::VirtualRegister(number, offset), original.operands[1].getBitSize());
     }
-    if (has_variable(mem_variables, variable::vsp) &&
-        has_variable(reg_variables, variable::vip_fetch))
+    if (mem_variables.has(role::vsp) &&
+        reg_variables.has(role::vip_fetch))
     {
+        probe = HandlerProbe{ position, false, reg };
         return vm::Push(vm::Immediate(static_cast<uint64_t>(reg_ast->evaluate())), reg.getBitSize());
     }
     // mov ax, byte ptr [vmregs + offset]
     // mov [vsp], ax
     //
-    if (has_variable(mem_variables, variable::vsp) &&
-        has_variable(reg_variables, variable::vregs))
+    if (mem_variables.has(role::vsp) &&
+        reg_variables.has(role::vregs))
     {
-        auto vreg = get_variable(reg_variables, variable::vregs).value();
+        auto vreg = reg_variables.get(role::vregs).value();
         uint64_t index{};
         if (std::sscanf(vreg->getComment().c_str(), "0x%lx", &index) != 1)
         {
@@ -452,52 +792,37 @@ std::optional<vm::Instruction> Tracer::process_store(const triton::arch::Instruc
         }
         auto number   = index / ptrsize();
         auto offset   = index % ptrsize();
-        auto original = lookup_instruction(get_variable(reg_variables, variable::vregs).value());
+        auto original = lookup_instruction(vreg);
+        probe = HandlerProbe{ positions.at(vreg), true, original.operands[1].getConstMemory().getConstIndexRegister() };
         return vm::Push(vm::VirtualRegister(number, offset), original.operands[1].getBitSize());
     }
-    if (has_variable(mem_variables, variable::vsp) &&
-        has_variable(reg_variables, variable::vsp))
+    if (mem_variables.has(role::vsp) &&
+        reg_variables.has(role::vsp))
     {
         return vm::Push(vm::VirtualStackPointer(), mem.getBitSize());
     }
-    if (has_variable(mem_variables, variable::vsp_fetch) &&
-        has_variable(reg_variables, variable::vsp_fetch))
+    if (mem_variables.has(role::vsp_fetch) &&
+        reg_variables.has(role::vsp_fetch))
     {
         return vm::Str(mem.getBitSize());
     }
-    if (has_variable(mem_variables, variable::vsp) &&
-        has_variable(reg_variables, variable::memory_fetch))
+    if (mem_variables.has(role::vsp) &&
+        reg_variables.has(role::memory_fetch))
     {
-        auto original = lookup_instruction(get_variable(reg_variables, variable::memory_fetch).value());
+        auto original = lookup_instruction(reg_variables.get(role::memory_fetch).value());
         return vm::Ldr(original.operands[1].getBitSize());
     }
-    if (has_variable(mem_variables, variable::vsp) && match_add(reg_ast))
-    {
-        return vm::Add(size);
-    }
-    if (has_variable(mem_variables, variable::vsp) && match_nand(reg_ast))
-    {
-        return vm::Nand(size);
-    }
-    if (has_variable(mem_variables, variable::vsp) && match_nor(reg_ast))
+    if (mem_variables.has(role::vsp))
     {
-        return vm::Nor(size);
-    }
-    if (has_variable(mem_variables, variable::vsp) && match_shr(reg_ast))
-    {
-        return vm::Shr(size);
-    }
-    if (has_variable(mem_variables, variable::vsp) && match_shl(reg_ast))
-    {
-        return vm::Shl(size);
-    }
-    if (has_variable(mem_variables, variable::vsp) && match_shrd(reg_ast))
-    {
-        return vm::Shrd(size);
-    }
-    if (has_variable(mem_variables, variable::vsp) && match_shld(reg_ast))
-    {
-        return vm::Shld(size);
+        const auto has_role = [this](const triton::ast::SharedAbstractNode& node, uint32_t var_role)
+        {
+            return role_of(to_variable(node)) == var_role;
+        };
+        std::optional<vm::Instruction> vinsn;
+        if (patterns::arithmetic::classify(reg_ast, has_role, [&]<typename T>() { vinsn = T(size); }))
+        {
+            return vinsn;
+        }
     }
     logger::warn("Failed to match store at 0x{:x}:", rip());
     logger::warn("\tmemory   AST: {}", mem_ast);
@@ -509,34 +834,34 @@ std::optional<vm::Instruction> Tracer::process_load(const triton::arch::Instruct
 {
     const auto& reg = insn.operands[0].getConstRegister();
     const auto& mem = insn.operands[1].getConstMemory();
-    const auto variables = collect_variables(mem.getLeaAst());
+    const auto mem_variables = variables(mem.getLeaAst());
 
-    if (has_variable(variables, variable::vip))
+    if (mem_variables.has(role::vip))
     {
-        cache_instruction(insn, symbolizeRegister(reg, variable::vip_fetch));
+        cache_instruction(insn, symbolize(reg, role::vip_fetch));
     }
-    else if (has_variable(variables, variable::vsp))
+    else if (mem_variables.has(role::vsp))
     {
-        cache_instruction(insn, symbolizeRegister(reg, variable::vsp_fetch));
+        cache_instruction(insn, symbolize(reg, role::vsp_fetch));
 
         if (vsp_register().isOverlapWith(reg))
         {
             return vm::Pop(vm::VirtualStackPointer(), mem.getBitSize());
         }
     }
-    else if (has_variable(variables, variable::rsp, variable::vip_fetch))
+    else if (mem_variables.only(role::rsp | role::vip_fetch))
     {
         // Set read offset as a comment to symbolic variable. It is used as vreg index in push vreg handler.
         //
-        auto var = symbolizeRegister(reg, variable::vregs);
+        auto var = symbolize(reg, role::vregs);
         var->setComment(fmt::format("0x{:x}", read(mem.getConstIndexRegister())));
         cache_instruction(insn, var);
     }
-    else if (has_variable(variables, variable::vsp_fetch))
+    else if (mem_variables.has(role::vsp_fetch))
     {
         // Set memory operand register name as a comment to symbolic variable. It is used as new vip register in jcc handler.
         //
-        auto var = symbolizeRegister(reg, variable::memory_fetch);
+        auto var = symbolize(reg, role::memory_fetch);
         var->setComment(fmt::format("{}", mem.getConstBaseRegister().getName()));
         cache_instruction(insn, var);
     }
@@ -545,6 +870,7 @@ std::optional<vm::Instruction> Tracer::process_load(const triton::arch::Instruct
 
 void Tracer::cache_instruction(triton::arch::Instruction insn, triton::engines::symbolic::SharedSymbolicVariable variable)
 {
+    positions.emplace(variable, position);
     cache.emplace(variable, insn);
 }
 
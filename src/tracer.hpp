@@ -3,19 +3,128 @@
 #include "emulator.hpp"
 #include "vm/instruction.hpp"
 
+#include <map>
+#include <set>
+#include <limits>
+#include <mutex>
+#include <memory>
+
 enum class step_t
 {
     stop_before_branch,
     execute_branch
 };
 
+// Roles of symbolic variables created by the tracer. Every role is a single bit so sets of
+// roles can be tested with integer operations.
+//
+namespace role
+{
+enum : uint32_t
+{
+    none         = 0,
+    rsp          = 1 << 0,
+    vip          = 1 << 1,
+    vip_fetch    = 1 << 2,
+    vsp          = 1 << 3,
+    vsp_fetch    = 1 << 4,
+    vregs        = 1 << 5,
+    memory_fetch = 1 << 6,
+};
+};
+
+// Symbolic variables of an AST with their roles folded into a mask.
+//
+struct Variables
+{
+    // At least one variable has `var_role`.
+    //
+    bool has(uint32_t var_role) const noexcept;
+
+    // Variables are exactly `roles`, one variable for each role.
+    //
+    bool only(uint32_t roles) const noexcept;
+
+    // First variable with `var_role`.
+    //
+    auto get(uint32_t var_role) const noexcept -> std::optional<triton::engines::symbolic::SharedSymbolicVariable>;
+
+    uint32_t mask = role::none;
+
+    std::vector<std::pair<uint32_t, triton::engines::symbolic::SharedSymbolicVariable>> list;
+};
+
+// Register value that has to be read while replaying a cached handler to restore its operand.
+//
+struct HandlerProbe
+{
+    // Position of the instruction in the handler stream.
+    //
+    size_t index;
+    // Read register after the instruction is executed.
+    //
+    bool after;
+    triton::arch::Register reg;
+};
+
+// Classified handler with everything required to decode it again with concrete execution only.
+//
+struct HandlerRecipe
+{
+    vm::Instruction shape;
+    // Addresses of executed x86 instructions.
+    //
+    std::vector<uint64_t> stream;
+    std::optional<HandlerProbe> probe;
+};
+
+// Handler entry address and virtual registers assignment.
+//
+struct HandlerKey
+{
+    uint64_t address;
+    std::string vip;
+    std::string vsp;
+
+    auto operator<=>(const HandlerKey&) const = default;
+};
+
+// Classified handlers shared by all tracers of a run, which may run on different threads. Recipes are
+// shared, so a found recipe stays valid without holding the lock even if it is evicted meanwhile.
+//
+struct HandlerCache
+{
+    std::shared_ptr<const HandlerRecipe> find(const HandlerKey& key);
+
+    void insert(const HandlerKey& key, HandlerRecipe recipe);
+
+    // Remove recipe of a handler whose replay diverged. The handler depends on data and is not
+    // cached again.
+    //
+    void evict(const HandlerKey& key);
+
+private:
+    std::mutex lock;
+    std::map<HandlerKey, std::shared_ptr<const HandlerRecipe>> recipes;
+    std::set<HandlerKey> unstable;
+};
+
+struct TracerPool;
+
 struct Tracer final : Emulator
 {
     Tracer(triton::arch::architecture_e arch) noexcept;
     Tracer(Tracer const& other) noexcept;
 
+    // Copy of this tracer borrowed from the pool.
+    //
     std::shared_ptr<Tracer> fork() const noexcept;
 
+    // Tracer with zero registers and unmodified memory borrowed from the pool. It shares the image
+    // and the caches with this one.
+    //
+    std::shared_ptr<Tracer> spawn() const noexcept;
+
     uint64_t vip() const;
     uint64_t vsp() const;
 
@@ -24,12 +133,56 @@ struct Tracer final : Emulator
 
     vm::Instruction step(step_t type);
 
+    // Execute at most `budget` instructions from the current rip and check whether they behave like vmenter.
+    // Invalid code is not fatal.
+    //
+    bool probe_vmenter(size_t budget);
+
+    // Store concrete state and virtual registers assignment. `load` expects a tracer returned by `spawn`.
+    //
+    void save(checkpoint::Writer& writer) const;
+    void load(checkpoint::Reader& reader);
+
 private:
+    friend TracerPool;
+
+    Tracer(triton::arch::architecture_e arch, std::shared_ptr<Binary> image) noexcept;
+
+    // Reset tracer and attach it to the image, caches and pool of `origin`.
+    //
+    void adopt(Tracer const& origin) noexcept;
+
+    std::optional<vm::Instruction> replay_handler(step_t type);
     std::optional<vm::Instruction> process_instruction();
-    std::optional<vm::Instruction> process_vmenter();
+    std::optional<vm::Instruction> process_handler(std::vector<triton::arch::Instruction>& stream);
+    std::optional<vm::Instruction> process_vmenter(size_t budget = std::numeric_limits<size_t>::max(), bool verbose = true);
     std::optional<vm::Instruction> process_store(const triton::arch::Instruction& insn);
     std::optional<vm::Instruction> process_load (const triton::arch::Instruction& insn);
 
+    // Symbolize register and remember the role of the new variable.
+    //
+    triton::engines::symbolic::SharedSymbolicVariable symbolize(const triton::arch::Register& reg, uint32_t var_role);
+
+    // Role of symbolic variable created by the current handler.
+    //
+    uint32_t role_of(const triton::engines::symbolic::SharedSymbolicVariable& var) const noexcept;
+
+    // Address of `mem` depends on symbolic base or index register.
+    //
+    bool is_symbolic_address(const triton::arch::MemoryAccess& mem) const;
+
+    // Concretize registers and memory and forget variables of the previous handler. Engines are
+    // recreated once `-symbolic-variable-limit` variables were created, so the symbolic state stays
+    // bounded over the run.
+    //
+    void reset_symbolic_state();
+
+    // Collect variables of `ast` and their roles.
+    //
+    Variables variables(const triton::ast::SharedAbstractNode& ast) const;
+
+    void remember_handler(const HandlerKey& key, const std::vector<triton::arch::Instruction>& stream, const vm::Instruction& vinsn);
+
     void cache_instruction(triton::arch::Instruction insn, triton::engines::symbolic::SharedSymbolicVariable variable);
     const triton::arch::Instruction& lookup_instruction(triton::engines::symbolic::SharedSymbolicVariable variable) const;
 
@@ -41,4 +194,48 @@ private:
     std::optional<std::string> vsp_register_name;
 
     std::unordered_map<triton::engines::symbolic::SharedSymbolicVariable, triton::arch::Instruction> cache;
+
+    // Position of the load instruction that created symbolic variable.
+    //
+    std::unordered_map<triton::engines::symbolic::SharedSymbolicVariable, size_t> positions;
+
+    // Position of the currently processed instruction in the handler stream.
+    //
+    size_t position;
+
+    // Operand source of the currently processed handler.
+    //
+    std::optional<HandlerProbe> probe;
+
+    // Roles of symbolic variables of the current handler indexed by variable id relative to `roles_base`.
+    //
+    std::vector<uint8_t> roles;
+    uint64_t roles_base;
+
+    // Classified handlers shared by all forks.
+    //
+    std::shared_ptr<HandlerCache> handlers;
+
+    // Pool the tracer is borrowed from and forks are taken from.
+    //
+    std::shared_ptr<TracerPool> pool;
+};
+
+// Idle tracers ready for reuse. Building a `triton::Context` sets up architecture tables, engines, modes
+// and callbacks. Reusing one clears its concrete state and drops its expressions, the engines are only
+// recreated once `-symbolic-variable-limit` variables piled up. Tracers may be borrowed and returned
+// from any thread.
+//
+struct TracerPool
+{
+    // Borrow tracer in the reset state attached to `origin`. It goes back to the pool once the last
+    // reference to it is dropped.
+    //
+    std::shared_ptr<Tracer> acquire(Tracer const& origin);
+
+private:
+    void release(Tracer* tracer) noexcept;
+
+    std::mutex lock;
+    std::vector<std::unique_ptr<Tracer>> idle;
 };
@@ -2,14 +2,33 @@
 
 #include <llvm/IR/Module.h>
 
-std::vector<triton::engines::symbolic::SharedSymbolicVariable> collect_variables(const triton::ast::SharedAbstractNode& ast)
+#include <unordered_set>
+
+void for_each_variable(const triton::ast::SharedAbstractNode& ast, const std::function<void(const triton::engines::symbolic::SharedSymbolicVariable&)>& fn)
 {
     using namespace triton::ast;
-    const auto vec = childrenExtraction(ast, true, true);
-    return vec
-        | ranges::views::filter   ([](const SharedAbstractNode& node){ return node->getType() == VARIABLE_NODE; })
-        | ranges::views::transform([](const SharedAbstractNode& node){ return std::dynamic_pointer_cast<VariableNode>(node)->getSymbolicVariable(); })
-        | ranges::to_vector;
+    std::vector<AbstractNode*> worklist{ ast.get() };
+    std::unordered_set<AbstractNode*> visited;
+
+    while (!worklist.empty())
+    {
+        auto node = worklist.back(); worklist.pop_back();
+        if (!node->isSymbolized() || !visited.insert(node).second)
+            continue;
+
+        switch (node->getType())
+        {
+        case VARIABLE_NODE:
+            fn(static_cast<VariableNode*>(node)->getSymbolicVariable());
+            break;
+        case REFERENCE_NODE:
+            worklist.push_back(static_cast<ReferenceNode*>(node)->getSymbolicExpression()->getAst().get());
+            break;
+        default:
+            for (const auto& child : node->getChildren())
+                worklist.push_back(child.get());
+        }
+    }
 }
 
 bool is_variable(const triton::ast::SharedAbstractNode& node, const std::string& alias)
@@ -5,34 +5,17 @@
 #include <triton/symbolicEngine.hpp>
 #include <triton/x86Specifications.hpp>
 
-#include <range/v3/view/filter.hpp>
-#include <range/v3/view/transform.hpp>
-#include <range/v3/range/conversion.hpp>
 #include <range/v3/algorithm/any_of.hpp>
-#include <range/v3/algorithm/find_if.hpp>
 
 #include <llvm/IR/Function.h>
+#include <functional>
 #include <optional>
 
-bool has_variable(const auto& range, const std::string& alias)
-{
-    return ranges::any_of(range, [&](const auto& node) { return node->getAlias() == alias; });
-}
-
-bool has_variable(const auto& range, const std::string& alias, const auto&... args)
-{
-    return range.size() == 1 + sizeof...(args) && has_variable(range, alias) && has_variable(range, args...);
-}
-
-auto get_variable(const auto& range, const std::string& alias) -> std::optional<triton::engines::symbolic::SharedSymbolicVariable>
-{
-    auto var = ranges::find_if(range, [&](const auto& var){ return var->getAlias() == alias; });
-    if (var != ranges::end(range))
-        return *var;
-    return {};
-}
+// Call `fn` once for every symbolic variable referenced by `ast`. References are followed and
+// subtrees without symbolic variables are skipped.
+//
+void for_each_variable(const triton::ast::SharedAbstractNode& ast, const std::function<void(const triton::engines::symbolic::SharedSymbolicVariable&)>& fn);
 
-auto collect_variables(const triton::ast::SharedAbstractNode& ast) -> std::vector<triton::engines::symbolic::SharedSymbolicVariable>;
 bool is_variable(const triton::ast::SharedAbstractNode& node, const std::string& alias = "");
 auto to_variable(const triton::ast::SharedAbstractNode& node) -> triton::engines::symbolic::SharedSymbolicVariable;
 
@@ -5,7 +5,16 @@ namespace vm
 {
 PhysicalRegister::PhysicalRegister(std::string name)
     : name_{ std::move(name) }
+    , id_  { physical_register_names.size() }
 {
+    for (size_t id = 0; id < physical_register_names.size(); id++)
+    {
+        if (physical_register_names[id] == name_)
+        {
+            id_ = id;
+            break;
+        }
+    }
 }
 
 const std::string& PhysicalRegister::name() const noexcept
@@ -13,6 +22,11 @@ const std::string& PhysicalRegister::name() const noexcept
     return name_;
 }
 
+size_t PhysicalRegister::id() const noexcept
+{
+    return id_;
+}
+
 VirtualRegister::VirtualRegister(int number, int offset)
     : number_{ number }, offset_{ offset }
 {
@@ -1,9 +1,11 @@
 #pragma once
 
+#include <array>
 #include <optional>
 #include <variant>
 #include <vector>
 #include <string>
+#include <string_view>
 
 struct Tracer;
 
@@ -15,14 +17,29 @@ enum class jcc_e
     down
 };
 
+// Physical registers of both architectures that virtual instructions may refer to.
+//
+inline constexpr std::array<std::string_view, 28> physical_register_names
+{
+    "rax", "rbx", "rcx", "rdx", "rsi", "rdi", "rbp", "rsp", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    "eax", "ebx", "ecx", "edx", "esi", "edi", "ebp", "esp", "eip", "rip",
+    "eflags", "rflags"
+};
+
 struct PhysicalRegister
 {
     explicit PhysicalRegister(std::string name);
 
     const std::string& name() const noexcept;
 
+    // Index of the register in `physical_register_names`, resolved once on construction so consumers
+    // do not look up the name. Unknown registers get `physical_register_names.size()`.
+    //
+    size_t id() const noexcept;
+
 private:
     std::string name_;
+    size_t id_;
 };
 
 struct VirtualRegister
@@ -14,16 +14,22 @@ BasicBlock* BasicBlock::fork(uint64_t vip)
 {
     if (owner->contains(vip))
     {
-        next.push_back(owner->blocks.at(vip));
+        link(owner->blocks.at(vip));
         return nullptr;
     }
 
     auto block = new BasicBlock(vip, owner);
 
-    next.push_back(block);
+    link(block);
     return block;
 }
 
+void BasicBlock::link(BasicBlock* block)
+{
+    next.push_back(block);
+    block->prev.push_back(this);
+}
+
 void BasicBlock::add(Instruction&& insn) noexcept
 {
     vins.push_back(std::move(insn));
@@ -68,6 +74,23 @@ bool Routine::contains(uint64_t vip) const noexcept
     return blocks.count(vip) > 0;
 }
 
+std::set<uint64_t> Routine::ancestors(uint64_t vip) const
+{
+    std::set<uint64_t> visited{ vip };
+    std::vector<const BasicBlock*> worklist{ blocks.at(vip) };
+    while (!worklist.empty())
+    {
+        auto block = worklist.back();
+        worklist.pop_back();
+        for (const auto pred : block->prev)
+        {
+            if (visited.insert(pred->vip()).second)
+                worklist.push_back(pred);
+        }
+    }
+    return visited;
+}
+
 std::string Routine::dot() const noexcept
 {
     std::string body = "digraph g {\n";
@@ -34,6 +34,10 @@ struct BasicBlock
     //
     BasicBlock* fork(uint64_t vip);
 
+    // Add edge from this block to `block`.
+    //
+    void link(BasicBlock* block);
+
     void add(Instruction&& insn) noexcept;
 
     auto begin() const noexcept { return vins.begin(); }
@@ -50,6 +54,10 @@ struct BasicBlock
 
     std::vector<BasicBlock*> next;
 
+    // Blocks that have an edge to this block.
+    //
+    std::vector<BasicBlock*> prev;
+
 private:
     uint64_t vip_;
 
@@ -67,6 +75,11 @@ struct Routine
 
     bool contains(uint64_t vip) const noexcept;
 
+    // Blocks from which block at `vip` can be reached, including the block itself. Walks the predecessors
+    // on every call, nothing is cached.
+    //
+    std::set<uint64_t> ancestors(uint64_t vip) const;
+
     // Build graphviz control-flow graph.
     //
     std::string dot() const noexcept;